@@ -0,0 +1,157 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <easyvk.h>
+#include "bench.h"
+
+// Headless regression suite: dispatch latency, transfer bandwidth and vect-add throughput. Only needs a
+// compute capable Vulkan implementation, so it also runs on software ICDs such as lavapipe.
+//
+// Usage: bench-suite [--device N] [--warmup N] [--reps N] [--json path] [--csv path]
+
+const uint64_t transferBytes = 16 * 1024 * 1024;
+const uint32_t vectAddSize = 1024 * 1024;
+const uint32_t vectAddWorkgroupSize = 64;
+
+int main(int argc, char **argv) {
+	uint32_t deviceIndex = 0;
+	uint32_t warmup = 10;
+	uint32_t reps = 100;
+	std::string jsonPath;
+	std::string csvPath;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--device") == 0) {
+			deviceIndex = std::stoul(argv[i + 1]);
+		} else if (strcmp(argv[i], "--warmup") == 0) {
+			warmup = std::stoul(argv[i + 1]);
+		} else if (strcmp(argv[i], "--reps") == 0) {
+			reps = std::stoul(argv[i + 1]);
+		} else if (strcmp(argv[i], "--json") == 0) {
+			jsonPath = argv[i + 1];
+		} else if (strcmp(argv[i], "--csv") == 0) {
+			csvPath = argv[i + 1];
+		} else {
+			std::cerr << "unknown option " << argv[i] << "\n";
+			return 1;
+		}
+	}
+
+	auto instance = easyvk::Instance(false);
+	auto physicalDevices = instance.physicalDevices();
+	auto device = easyvk::Device(instance, physicalDevices.at(deviceIndex));
+	std::cout << "Using device: " << device.properties.deviceName << "\n";
+	auto harness = bench::Harness(warmup, reps);
+
+	// Dispatch latency of a tiny kernel, as seen by the host and by the device
+	{
+		auto a = easyvk::Buffer(device, 64 * sizeof(uint32_t));
+		std::vector<easyvk::Buffer> bufs = {a};
+		std::vector<uint32_t> spvCode =
+		#include "build/empty.cinit"
+		;
+		auto program = easyvk::Program(device, spvCode, bufs);
+		program.setWorkgroups(1);
+		program.setWorkgroupSize(64);
+		program.initialize("empty");
+		harness.measureHost("dispatch/host", [&]() { program.run(); });
+		harness.measure("dispatch/device", [&]() { return (double)program.runWithDispatchTiming(); });
+		program.teardown();
+		a.teardown();
+	}
+
+	// Host to device and device to host bandwidth for both kinds of buffer
+	{
+		std::vector<uint8_t> host(transferBytes, 1);
+		for (bool deviceLocal : {false, true}) {
+			auto buffer = easyvk::Buffer(device, transferBytes, deviceLocal);
+			std::string kind = deviceLocal ? "device-local" : "host-visible";
+			harness.measureHost("store/" + kind, [&]() { buffer.store(host.data(), transferBytes); }, transferBytes);
+			harness.measureHost("load/" + kind, [&]() { buffer.load(host.data(), transferBytes); }, transferBytes);
+			buffer.teardown();
+		}
+	}
+
+	// Wrapping existing host memory, which only copies when the device can't import it
+	{
+		uint64_t alignment = std::max<uint64_t>(device.minImportedHostPointerAlignment, 4096);
+		void *host = std::aligned_alloc(alignment, transferBytes);
+		memset(host, 1, transferBytes);
+		auto probe = easyvk::Buffer(device, host, transferBytes);
+		std::string kind = probe.imported ? "imported" : "copied";
+		probe.teardown();
+		harness.measureHost("wrap/" + kind, [&]() {
+			auto buffer = easyvk::Buffer(device, host, transferBytes);
+			buffer.teardown();
+		}, transferBytes);
+		free(host);
+	}
+
+	// Cost of creating, clearing and destroying a short lived buffer
+	{
+		harness.measureHost("buffer/churn", [&]() {
+			auto buffer = easyvk::Buffer(device, 4096, true);
+			buffer.clear();
+			buffer.teardown();
+		});
+	}
+
+	// vect-add throughput, counting the two inputs read and the output written
+	{
+		auto a = easyvk::Buffer(device, vectAddSize * sizeof(uint32_t), true);
+		auto b = easyvk::Buffer(device, vectAddSize * sizeof(float), true);
+		auto c = easyvk::Buffer(device, vectAddSize * sizeof(float), true);
+		std::vector<easyvk::Buffer> bufs = {a, b, c};
+		std::vector<uint32_t> spvCode =
+		#include "build/vect-add.cinit"
+		;
+		auto program = easyvk::Program(device, spvCode, bufs);
+		program.setWorkgroups(vectAddSize / vectAddWorkgroupSize);
+		program.setWorkgroupSize(vectAddWorkgroupSize);
+		program.initialize("litmus_test");
+		harness.measure("vect-add/device", [&]() { return (double)program.runWithDispatchTiming(); }, 3 * vectAddSize * sizeof(float));
+
+		// Swapping the output buffer between runs, which must not recompile the pipeline
+		auto d = easyvk::Buffer(device, vectAddSize * sizeof(float), true);
+		bool swapped = false;
+		harness.measureHost("vect-add/rebind", [&]() {
+			swapped = !swapped;
+			program.bind(2, swapped ? d : c);
+			program.run();
+		});
+		program.teardown();
+		a.teardown();
+		b.teardown();
+		c.teardown();
+		d.teardown();
+	}
+
+	harness.print();
+	if (!jsonPath.empty()) {
+		harness.writeJson(jsonPath);
+	}
+	if (!csvPath.empty()) {
+		harness.writeCsv(csvPath);
+	}
+
+	device.teardown();
+	instance.teardown();
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <easyvk.h>
+#include "bench.h"
+
+namespace bench
+{
+
+  // Linear interpolation between the closest ranks of a sorted sample
+  double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+      return 0;
+    }
+    double rank = p * (sorted.size() - 1);
+    size_t lower = (size_t)rank;
+    size_t upper = std::min(lower + 1, sorted.size() - 1);
+    return sorted[lower] + (rank - lower) * (sorted[upper] - sorted[lower]);
+  }
+
+  Stats summarize(std::string name, std::vector<double> samples, uint64_t bytes) {
+    std::sort(samples.begin(), samples.end());
+    double q1 = percentile(samples, 0.25);
+    double q3 = percentile(samples, 0.75);
+    double iqr = q3 - q1;
+    std::vector<double> kept;
+    for (double sample : samples) {
+      if (sample >= q1 - 1.5 * iqr && sample <= q3 + 1.5 * iqr) {
+        kept.push_back(sample);
+      }
+    }
+
+    Stats stats {};
+    stats.name = name;
+    stats.samples = kept.size();
+    stats.outliers = samples.size() - kept.size();
+    stats.bytes = bytes;
+    if (kept.empty()) {
+      return stats;
+    }
+    double sum = 0;
+    for (double sample : kept) {
+      sum += sample;
+    }
+    stats.mean = sum / kept.size();
+    double squares = 0;
+    for (double sample : kept) {
+      squares += (sample - stats.mean) * (sample - stats.mean);
+    }
+    stats.stddev = kept.size() > 1 ? std::sqrt(squares / (kept.size() - 1)) : 0;
+    stats.median = percentile(kept, 0.5);
+    stats.p99 = percentile(kept, 0.99);
+    stats.min = kept.front();
+    stats.max = kept.back();
+    stats.gbPerSecond = bytes > 0 && stats.median > 0 ? bytes / stats.median : 0;
+    return stats;
+  }
+
+  Harness::Harness(uint32_t _warmup, uint32_t _repetitions) : warmup(_warmup), repetitions(_repetitions) {}
+
+  Stats Harness::measure(std::string name, std::function<double()> sample, uint64_t bytes) {
+    for (uint32_t i = 0; i < warmup; i++) {
+      sample();
+    }
+    std::vector<double> samples(repetitions);
+    for (auto &s : samples) {
+      s = sample();
+    }
+    results.push_back(summarize(name, samples, bytes));
+    return results.back();
+  }
+
+  Stats Harness::measureHost(std::string name, std::function<void()> fn, uint64_t bytes) {
+    return measure(name, [&]() {
+      auto start = std::chrono::steady_clock::now();
+      fn();
+      auto end = std::chrono::steady_clock::now();
+      return std::chrono::duration<double, std::nano>(end - start).count();
+    }, bytes);
+  }
+
+  void Harness::print() {
+    printf("%-40s %12s %12s %12s %12s %6s %10s\n", "benchmark", "median ns", "mean ns", "stddev ns", "p99 ns", "out", "GB/s");
+    for (const auto &stats : results) {
+      printf("%-40s %12.0f %12.0f %12.0f %12.0f %6lu %10.2f\n", stats.name.c_str(), stats.median, stats.mean, stats.stddev,
+        stats.p99, (unsigned long)stats.outliers, stats.gbPerSecond);
+    }
+  }
+
+  // Quotes a CSV field if it holds a separator, quote or line break, doubling any quotes inside it
+  std::string csvField(const std::string &text) {
+    if (text.find_first_of(",\"\r\n") == std::string::npos) {
+      return text;
+    }
+    std::string quoted = "\"";
+    for (char c : text) {
+      quoted += c == '"' ? "\"\"" : std::string(1, c);
+    }
+    return quoted + "\"";
+  }
+
+  void Harness::writeJson(const std::string &path) {
+    auto fout = std::ofstream(path, std::ios::trunc);
+    if (!fout.is_open()) {
+      throw std::runtime_error("failed opening file " + path + " for writing");
+    }
+    fout << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      const auto &stats = results[i];
+      fout << "  {\"name\": \"" << easyvk::jsonEscape(stats.name) << "\", \"samples\": " << stats.samples << ", \"outliers\": " << stats.outliers
+           << ", \"median_ns\": " << stats.median << ", \"mean_ns\": " << stats.mean << ", \"stddev_ns\": " << stats.stddev
+           << ", \"p99_ns\": " << stats.p99 << ", \"min_ns\": " << stats.min << ", \"max_ns\": " << stats.max
+           << ", \"bytes\": " << stats.bytes << ", \"gb_per_s\": " << stats.gbPerSecond << "}"
+           << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    fout << "]\n";
+  }
+
+  void Harness::writeCsv(const std::string &path) {
+    auto fout = std::ofstream(path, std::ios::trunc);
+    if (!fout.is_open()) {
+      throw std::runtime_error("failed opening file " + path + " for writing");
+    }
+    fout << "name,samples,outliers,median_ns,mean_ns,stddev_ns,p99_ns,min_ns,max_ns,bytes,gb_per_s\n";
+    for (const auto &stats : results) {
+      fout << csvField(stats.name) << "," << stats.samples << "," << stats.outliers << "," << stats.median << "," << stats.mean << ","
+           << stats.stddev << "," << stats.p99 << "," << stats.min << "," << stats.max << "," << stats.bytes << ","
+           << stats.gbPerSecond << "\n";
+    }
+  }
+
+}
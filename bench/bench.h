@@ -0,0 +1,73 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef EASYVK_BENCH_H
+#define EASYVK_BENCH_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+
+  typedef struct Stats {
+    std::string name;
+    // Samples kept after outlier rejection, and how many were rejected
+    uint64_t samples;
+    uint64_t outliers;
+    // All times in nanoseconds
+    double median;
+    double mean;
+    double stddev;
+    double p99;
+    double min;
+    double max;
+    // Bytes moved per sample, if the benchmark measures bandwidth
+    uint64_t bytes;
+    // Bytes per nanosecond of the median sample, which is also GB/s
+    double gbPerSecond;
+  } Stats;
+
+  // Summarizes samples, dropping those outside the Tukey fences (1.5 IQR past the quartiles)
+  Stats summarize(std::string name, std::vector<double> samples, uint64_t bytes = 0);
+
+  /**
+   * Runs each benchmark for a number of warmup iterations, then times a number of repetitions and keeps
+   * the summarized results so they can be printed and written out as JSON or CSV.
+   */
+  class Harness {
+  public:
+    Harness(uint32_t _warmup = 10, uint32_t _repetitions = 100);
+    // sample runs one repetition and returns the time it measured in nanoseconds, e.g. a device timestamp delta
+    Stats measure(std::string name, std::function<double()> sample, uint64_t bytes = 0);
+    // Times one repetition of fn with the host's steady clock
+    Stats measureHost(std::string name, std::function<void()> fn, uint64_t bytes = 0);
+    void print();
+    void writeJson(const std::string &path);
+    void writeCsv(const std::string &path);
+
+    std::vector<Stats> results;
+
+  private:
+    uint32_t warmup;
+    uint32_t repetitions;
+  };
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <iostream>
+#include <easyvk.h>
+
+// Checks that Program::run() does no heap allocations once its command buffer has been recorded.
+// Every global operator new in the process is counted, including the ones made inside easyvk.
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(std::size_t size) {
+	allocations++;
+	if (void *p = std::malloc(size == 0 ? 1 : size)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+	std::free(p);
+}
+
+const int size = 64;
+const int iters = 10000;
+
+int main() {
+	auto instance = easyvk::Instance(false);
+	auto physicalDevices = instance.physicalDevices();
+	auto device = easyvk::Device(instance, physicalDevices.at(0));
+	std::cout << "Using device: " << device.properties.deviceName << "\n";
+
+	auto a = easyvk::Buffer(device, size * sizeof(uint32_t));
+	std::vector<easyvk::Buffer> bufs = {a};
+	std::vector<uint32_t> spvCode =
+	#include "build/empty.cinit"
+	;
+	auto program = easyvk::Program(device, spvCode, bufs);
+	program.setWorkgroups(size);
+	program.setWorkgroupSize(1);
+	program.initialize("empty");
+
+	// The first run records the command buffer and sizes the device's submission scratch space.
+	program.run();
+
+	uint64_t before = allocations;
+	for (int i = 0; i < iters; i++) {
+		program.run();
+	}
+	uint64_t perDispatch = allocations - before;
+
+	printf("%lu allocations over %d dispatches\n", (unsigned long)perDispatch, iters);
+
+	a.teardown();
+	program.teardown();
+	device.teardown();
+	instance.teardown();
+
+	if (perDispatch != 0) {
+		printf("FAILED: run() allocated in steady state\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <iostream>
+#include <easyvk.h>
+
+// Measures the host side cost of Program::run() for a tiny dispatch, so that submit and
+// wait dominate over the GPU work itself.
+const int size = 64;
+const int iters = 10000;
+
+int main() {
+	auto instance = easyvk::Instance(false);
+	auto physicalDevices = instance.physicalDevices();
+	auto device = easyvk::Device(instance, physicalDevices.at(0));
+	std::cout << "Using device: " << device.properties.deviceName << "\n";
+
+	auto a = easyvk::Buffer(device, size * sizeof(uint32_t));
+	std::vector<easyvk::Buffer> bufs = {a};
+	std::vector<uint32_t> spvCode =
+	#include "build/empty.cinit"
+	;
+	auto program = easyvk::Program(device, spvCode, bufs);
+	program.setWorkgroups(size);
+	program.setWorkgroupSize(1);
+	program.initialize("empty");
+
+	// Warm up, this also records the command buffer once.
+	for (int i = 0; i < 100; i++) {
+		program.run();
+	}
+
+	// Re-recording on every call, which is what every run() did before command buffers were cached.
+	// Alternating the workgroup count invalidates the recorded command buffer.
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iters; i++) {
+		program.setWorkgroups(size - (i & 1));
+		program.run();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double rerecordNs = std::chrono::duration<double, std::nano>(end - start).count() / iters;
+
+	// Replaying the cached command buffer.
+	program.setWorkgroups(size);
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iters; i++) {
+		program.run();
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double replayNs = std::chrono::duration<double, std::nano>(end - start).count() / iters;
+
+	printf("run() re-recorded: %.0fns per dispatch\n", rerecordNs);
+	printf("run() replayed:    %.0fns per dispatch\n", replayNs);
+	printf("saved:             %.0fns per dispatch\n", rerecordNs - replayNs);
+
+	a.teardown();
+	program.teardown();
+	device.teardown();
+	instance.teardown();
+	return 0;
+}
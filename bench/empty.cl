@@ -0,0 +1,4 @@
+__kernel void empty(__global uint *a) {
+	uint id = get_global_id(0);
+	a[id] = id;
+}
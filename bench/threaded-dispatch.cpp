@@ -0,0 +1,117 @@
+/*
+   Copyright 2023 Reese	Levine,	Devon McKee, Sean Siddens
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <easyvk.h>
+
+// Stress test for concurrent submission: every thread builds its own buffers and Program on a shared
+// Device and repeatedly runs vect-add, storing inputs and loading the device local output through the
+// device's shared staging ring and its own transfer command pool. Each result is checked, then read
+// back again with loadAsync, which must have landed by the time its completion reports done.
+//
+// Usage: threaded-dispatch [threads] [iterations]
+
+const int size = 1024 * 16;
+
+int main(int argc, char **argv) {
+	int numThreads = argc > 1 ? std::stoi(argv[1]) : 8;
+	int iters = argc > 2 ? std::stoi(argv[2]) : 200;
+
+	auto instance = easyvk::Instance(false);
+	auto physicalDevices = instance.physicalDevices();
+	auto device = easyvk::Device(instance, physicalDevices.at(0));
+	std::cout << "Using device: " << device.properties.deviceName << "\n";
+
+	std::vector<uint32_t> spvCode =
+	#include "build/vect-add.cinit"
+	;
+
+	std::atomic<int> failures{0};
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < numThreads; t++) {
+		threads.emplace_back([&, t]() {
+			auto a = easyvk::Buffer(device, size * sizeof(uint32_t));
+			auto b = easyvk::Buffer(device, size * sizeof(float), true);
+			auto c = easyvk::Buffer(device, size * sizeof(float), true);
+			std::vector<easyvk::Buffer> bufs = {a, b, c};
+			auto program = easyvk::Program(device, spvCode, bufs);
+			program.setWorkgroups(size / 64);
+			program.setWorkgroupSize(64);
+			program.initialize("litmus_test");
+
+			std::vector<uint32_t> aHost(size);
+			std::vector<float> bHost(size);
+			std::vector<float> cHost(size);
+			std::vector<float> cAsync(size);
+			for (int n = 0; n < iters; n++) {
+				for (int i = 0; i < size; i++) {
+					aHost[i] = i;
+					bHost[i] = t * iters + n;
+				}
+				a.store(aHost.data(), size * sizeof(uint32_t));
+				auto stored = b.storeAsync(bHost.data(), size * sizeof(float));
+				stored.wait();
+				program.run();
+				c.load(cHost.data(), size * sizeof(float));
+				for (int i = 0; i < size; i++) {
+					if (cHost[i] != aHost[i] + bHost[i]) {
+						failures++;
+						break;
+					}
+				}
+
+				// Alternate between waiting and polling, the readback has to be complete either way
+				std::fill(cAsync.begin(), cAsync.end(), -1.0f);
+				auto loaded = c.loadAsync(cAsync.data(), size * sizeof(float));
+				if (n % 2 == 0) {
+					loaded.wait();
+				} else {
+					while (!loaded.done()) {
+						std::this_thread::yield();
+					}
+				}
+				if (memcmp(cAsync.data(), cHost.data(), size * sizeof(float)) != 0) {
+					failures++;
+				}
+			}
+
+			program.teardown();
+			a.teardown();
+			b.teardown();
+			c.teardown();
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double ms = std::chrono::duration<double, std::milli>(end - start).count();
+	printf("%d threads x %d iterations in %.1fms, %d failures\n", numThreads, iters, ms, failures.load());
+
+	device.teardown();
+	instance.teardown();
+	return failures == 0 ? 0 : 1;
+}
@@ -71,7 +71,7 @@ int main() {
 		// Run the kernel.
 		printf("Running program...\n");
 		program.initialize("litmus_test");
-		float runtime = program.runWithDispatchTiming();
+		uint64_t runtime = program.runWithDispatchTiming();
 		printf("Performed vector add in %.5fms\n", runtime / 1000000.0);
 
 		// Check the output.
@@ -173,6 +173,40 @@ namespace easyvk {
     }
   }
 
+  std::string jsonEscape(const std::string &text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char c : text) {
+      switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\r':
+        escaped += "\\r";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          // Remaining control characters have no short escape
+          char code[7];
+          snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+          escaped += code;
+        } else {
+          escaped += c;
+        }
+      }
+    }
+    return escaped;
+  }
+
   static auto VKAPI_ATTR debugReporter(VkDebugReportFlagsEXT, VkDebugReportObjectTypeEXT, uint64_t, size_t, int32_t, const char *pLayerPrefix, const char *pMessage, void *pUserData) -> VkBool32 {
     std::cerr << "\x1B[31m[Vulkan:" << pLayerPrefix << "]\033[0m " << pMessage << "\n";
     return VK_FALSE;
@@ -289,22 +323,69 @@ namespace easyvk {
     return computeFamilyId;
   }
 
-  Device::Device(easyvk::Instance &_instance, VkPhysicalDevice _physicalDevice) : instance(_instance),
+  // Picks the queue used for transfers: a transfer-only family (usually a dedicated DMA engine) if one
+  // exists, otherwise a second queue of the compute family. queueIndex is left at 0 when sharing the
+  // compute queue itself.
+  uint32_t getTransferFamilyId(VkPhysicalDevice physicalDevice, uint32_t computeFamilyId, uint32_t &queueIndex) {
+    uint32_t queueFamilyPropertyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, nullptr);
+
+    std::vector<VkQueueFamilyProperties> familyProperties(queueFamilyPropertyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, familyProperties.data());
+
+    queueIndex = 0;
+    for (uint32_t i = 0; i < queueFamilyPropertyCount; i++) {
+      VkQueueFlags flags = familyProperties[i].queueFlags;
+      if (familyProperties[i].queueCount > 0 && (flags & VK_QUEUE_TRANSFER_BIT)
+          && !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT))) {
+        return i;
+      }
+    }
+    if (familyProperties[computeFamilyId].queueCount > 1) {
+      queueIndex = 1;
+    }
+    return computeFamilyId;
+  }
+
+  Device::Device(easyvk::Instance &_instance, VkPhysicalDevice _physicalDevice, uint64_t _stagingBudget, uint64_t _memoryBlockSize) : computeFamilyId(getComputeFamilyId(_physicalDevice)),
+                                                                                  instance(_instance),
                                                                                   physicalDevice(_physicalDevice),
-                                                                                  computeFamilyId(getComputeFamilyId(_physicalDevice)) {
+                                                                                  stagingBudget(_stagingBudget),
+                                                                                  memoryBlockSize(_memoryBlockSize) {
+
+    uint32_t transferQueueIndex;
+    transferFamilyId = getTransferFamilyId(physicalDevice, computeFamilyId, transferQueueIndex);
 
-    auto priority = float(1.0);
-    auto queues = std::array<VkDeviceQueueCreateInfo, 1>{};
+    uint32_t queueFamilyPropertyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> familyProperties(queueFamilyPropertyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertyCount, familyProperties.data());
+    timestampValidBits = familyProperties[computeFamilyId].timestampValidBits;
 
-    // Define device queue info
+    auto priorities = std::array<float, 2>{1.0, 1.0};
+    auto queues = std::array<VkDeviceQueueCreateInfo, 2>{};
+    uint32_t queueCreateInfoCount = 1;
+
+    // Define device queue info, asking for a second compute queue when transfers share its family
     queues[0] = VkDeviceQueueCreateInfo{
       VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
       nullptr,
       VkDeviceQueueCreateFlags{},
       computeFamilyId,
-      1,
-      &priority
+      1 + transferQueueIndex,
+      priorities.data()
     };
+    if (transferFamilyId != computeFamilyId) {
+      queues[1] = VkDeviceQueueCreateInfo{
+        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        nullptr,
+        VkDeviceQueueCreateFlags{},
+        transferFamilyId,
+        1,
+        priorities.data()
+      };
+      queueCreateInfoCount = 2;
+    }
 
     // check for support for extensions
     uint32_t pPropertyCount;
@@ -312,6 +393,9 @@ namespace easyvk {
     std::vector<VkExtensionProperties> extensions(pPropertyCount);
     vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &pPropertyCount, extensions.data()); 
     supportsAMDShaderStats = false;
+    supportsCalibratedTimestamps = false;
+    supportsHostImport = false;
+    supportsPushDescriptors = false;
     
     std::vector<const char *> enabledExtensions{};
     for (const auto& extension : extensions) {
@@ -323,6 +407,24 @@ namespace easyvk {
         enabledExtensions.push_back("VK_KHR_portability_subset");
       } else if (strcmp(extension.extensionName, "VK_KHR_shader_non_semantic_info") == 0) {
         enabledExtensions.push_back("VK_KHR_shader_non_semantic_info");
+      } else if (strcmp(extension.extensionName, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0) {
+        // only useful when both the device and the host's monotonic clock can be sampled together
+        uint32_t domainCount = 0;
+        vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(physicalDevice, &domainCount, nullptr);
+        std::vector<VkTimeDomainEXT> domains(domainCount);
+        vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(physicalDevice, &domainCount, domains.data());
+        bool deviceDomain = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT) != domains.end();
+        bool monotonicDomain = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT) != domains.end();
+        if (deviceDomain && monotonicDomain) {
+          enabledExtensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+          supportsCalibratedTimestamps = true;
+        }
+      } else if (strcmp(extension.extensionName, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0) {
+        enabledExtensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+        supportsHostImport = true;
+      } else if (strcmp(extension.extensionName, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0) {
+        enabledExtensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+        supportsPushDescriptors = true;
       }
     }
 
@@ -345,6 +447,9 @@ namespace easyvk {
     features2.pNext = &vulkan12Features;
     vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
     features2.features.robustBufferAccess = false;
+    // every supported feature is enabled, so this also turns on the query feature
+    supportsPipelineStatistics = features2.features.pipelineStatisticsQuery;
+    supportsBufferDeviceAddress = vulkan12Features.bufferDeviceAddress;
 
     // Define device info
     VkDeviceCreateInfo deviceCreateInfo;
@@ -352,7 +457,7 @@ namespace easyvk {
         VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         &vulkan12Features,
         VkDeviceCreateFlags{},
-        1,
+        queueCreateInfoCount,
         queues.data(),
         0,
         nullptr,
@@ -363,19 +468,70 @@ namespace easyvk {
     // Create device
     vkCheck(vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &device));
 
-    // Get queue handle.
+    // Get queue handles.
     vkGetDeviceQueue(device, computeFamilyId, 0, &computeQueue);
+    vkGetDeviceQueue(device, transferFamilyId, transferQueueIndex, &transferQueue);
+
+    if (supportsCalibratedTimestamps) {
+      getCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr(device, "vkGetCalibratedTimestampsEXT");
+    }
+    if (supportsHostImport) {
+      getMemoryHostPointerProperties = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr(device, "vkGetMemoryHostPointerPropertiesEXT");
+      VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties = {};
+      hostProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+      VkPhysicalDeviceProperties2 physicalDeviceProperties = {};
+      physicalDeviceProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      physicalDeviceProperties.pNext = &hostProperties;
+      vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+      minImportedHostPointerAlignment = hostProperties.minImportedHostPointerAlignment;
+    }
+    if (supportsPushDescriptors) {
+      cmdPushDescriptorSet = (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr(device, "vkCmdPushDescriptorSetKHR");
+      VkPhysicalDevicePushDescriptorPropertiesKHR pushProperties = {};
+      pushProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PUSH_DESCRIPTOR_PROPERTIES_KHR;
+      VkPhysicalDeviceProperties2 physicalDeviceProperties = {};
+      physicalDeviceProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      physicalDeviceProperties.pNext = &pushProperties;
+      vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+      maxPushDescriptors = pushProperties.maxPushDescriptors;
+    }
+
+    // Create the timeline semaphore that tracks completion of submissions to the queue
+    VkSemaphoreTypeCreateInfo timelineCreateInfo {
+      VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      nullptr,
+      VK_SEMAPHORE_TYPE_TIMELINE,
+      0
+    };
+    VkSemaphoreCreateInfo semaphoreCreateInfo {
+      VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      &timelineCreateInfo,
+      0
+    };
+    vkCheck(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &computeTimeline));
+    transferTimeline = computeTimeline;
+    if (hasTransferQueue()) {
+      vkCheck(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &transferTimeline));
+    }
 
     // Get device properties
     vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    // Starts empty, call loadPipelineCache to reuse pipelines compiled by an earlier run
+    VkPipelineCacheCreateInfo cacheCreateInfo {
+      VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      nullptr,
+      0,
+      0,
+      nullptr
+    };
+    vkCheck(vkCreatePipelineCache(device, &cacheCreateInfo, nullptr, &pipelineCache));
   }
 
   uint32_t Device::selectMemory(uint32_t memoryTypeBits, VkMemoryPropertyFlags flags) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-      if ((memoryTypeBits & (1u << i)) && ((flags & memProperties.memoryTypes[i].propertyFlags) == flags)) {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+      if ((memoryTypeBits & (1u << i)) && ((flags & memoryProperties.memoryTypes[i].propertyFlags) == flags)) {
         return i;
       }
     }
@@ -395,377 +551,2042 @@ namespace easyvk {
     return subgroupProperties.subgroupSize;
   }
 
+  std::array<uint8_t, VK_UUID_SIZE> Device::uuid() {
+    VkPhysicalDeviceIDProperties idProperties = {};
+    idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    idProperties.pNext = NULL;
+
+    VkPhysicalDeviceProperties2 physicalDeviceProperties = {};
+    physicalDeviceProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    physicalDeviceProperties.pNext = &idProperties;
+
+    vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+    std::array<uint8_t, VK_UUID_SIZE> result;
+    memcpy(result.data(), idProperties.deviceUUID, VK_UUID_SIZE);
+    return result;
+  }
+
+  uint32_t Device::hostPointerMemoryTypes(const void *pointer) {
+    if (getMemoryHostPointerProperties == nullptr) {
+      return 0;
+    }
+    VkMemoryHostPointerPropertiesEXT pointerProperties {
+      VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+      nullptr,
+      0
+    };
+    if (getMemoryHostPointerProperties(device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, pointer, &pointerProperties) != VK_SUCCESS) {
+      return 0;
+    }
+    return pointerProperties.memoryTypeBits;
+  }
+
   const char* Device::vendorName() {
     return vkVendorName(properties.vendorID);
   }
 
-  void Device::teardown() {
-    vkDestroyDevice(device, nullptr);
+  StagingRing &Device::stagingRing() {
+    std::lock_guard<std::mutex> guard(objectsLock);
+    if (staging == nullptr) {
+      staging = new StagingRing(*this, stagingBudget);
+    }
+    return *staging;
   }
 
+  MemoryArena &Device::memoryArena() {
+    std::lock_guard<std::mutex> guard(objectsLock);
+    if (arena == nullptr) {
+      arena = new MemoryArena(*this, memoryBlockSize);
+    }
+    return *arena;
+  }
 
-// -------------------------------------------------------------------------------
-
-  Buffer::Buffer(Device &device, uint64_t sizeBytes, bool deviceLocal) : device(device), size(sizeBytes), deviceLocal(deviceLocal) {
-    // Create VkBuffer    
-    VkMemoryPropertyFlags memProp = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-    if (deviceLocal) {
-      memProp = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;  
-    }  
-    VkBufferUsageFlags usage = 
-        VK_BUFFER_USAGE_TRANSFER_SRC_BIT 
-      | VK_BUFFER_USAGE_TRANSFER_DST_BIT 
-      | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    _createVkBuffer(&buffer, &memory, sizeBytes, usage, memProp);
-   
-    // Create command pool for copy commands
-    VkCommandPoolCreateInfo commandPoolCreateInfo {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .queueFamilyIndex = device.computeFamilyId
-    };
-    vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+  LayoutCache &Device::layoutCache() {
+    std::lock_guard<std::mutex> guard(objectsLock);
+    if (layouts == nullptr) {
+      layouts = new LayoutCache(*this);
+    }
+    return *layouts;
+  }
 
-		// Allocate command buffer from command pool
-		VkCommandBufferAllocateInfo commandBufferAllocInfo {
-			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-			.commandPool = commandPool,
-			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-			.commandBufferCount = 1
-		};
-		vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAllocInfo, &commandBuffer));
+  MemoryStats Device::memoryStats() {
+    return memoryArena().stats();
   }
 
-  void Buffer::_createVkBuffer(VkBuffer* buf, VkDeviceMemory* mem, uint64_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props) {
-    // Creating VkBuffer    
-    VkBufferCreateInfo bufferInfo {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = size,
-      .usage = usage,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-    vkCheck(vkCreateBuffer(device.device, &bufferInfo, nullptr, buf));
-    
-    // Allocating memory to it
-    VkMemoryRequirements memReqs;
-    vkGetBufferMemoryRequirements(device.device, *buf, &memReqs);
-    VkMemoryAllocateInfo allocInfo {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      .memoryTypeIndex = device.selectMemory(memReqs.memoryTypeBits, props)
-    }; 
-    vkCheck(vkAllocateMemory(device.device, &allocInfo, nullptr, mem));
-    vkCheck(vkBindBufferMemory(device.device, *buf, *mem, 0));
+  // Owns the calling thread's transfer pools and frees them when the thread exits, so a recycled thread
+  // id never picks up a dead thread's pool. Holding each device's registry keeps its address from being
+  // reused as the key of a later device.
+  typedef struct ThreadTransferPools {
+    std::map<TransferPools*, std::pair<std::shared_ptr<TransferPools>, TransferPool*>> pools;
+    ~ThreadTransferPools() {
+      for (auto &[key, entry] : pools) {
+        auto &[registry, pool] = entry;
+        std::lock_guard<std::mutex> guard(registry->lock);
+        // Pools of devices that were already torn down were freed with them
+        if (registry->open) {
+          registry->pools.erase(pool);
+          pool->teardown();
+          delete pool;
+        }
+      }
+    }
+  } ThreadTransferPools;
+
+  thread_local ThreadTransferPools threadTransferPools;
+
+  TransferPool &Device::transferPool() {
+    auto &[registry, pool] = threadTransferPools.pools[transfers.get()];
+    if (pool == nullptr) {
+      registry = transfers;
+      pool = new TransferPool(*this);
+      std::lock_guard<std::mutex> guard(transfers->lock);
+      transfers->pools.insert(pool);
+    }
+    return *pool;
   }
 
-  void Buffer::teardown() {
-		vkFreeCommandBuffers(device.device, commandPool, 1, &commandBuffer);
-		vkDestroyCommandPool(device.device, commandPool, nullptr);
-		vkFreeMemory(device.device, memory, nullptr);
-    vkDestroyBuffer(device.device, buffer, nullptr);
+  uint64_t hostClockNs() {
+    // steady_clock is CLOCK_MONOTONIC on Linux and Android, the host domain used for calibration
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
   }
 
-  void Buffer::_copy(VkBuffer src, VkBuffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
-    // Begin recording command buffer, record command to copy buffer to buffer, end command buffer record
-    VkCommandBufferBeginInfo beginInfo {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
-    };
-    vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
-    VkBufferCopy copyRegion {
-      .srcOffset = srcOffset,
-      .dstOffset = dstOffset,
-      .size = len
-    };
-    vkCmdCopyBuffer(commandBuffer, src, dst, 1, &copyRegion);
-    vkCheck(vkEndCommandBuffer(commandBuffer));
+  // How long a calibration is trusted before clock drift makes it worth redoing
+  const uint64_t calibration_interval_ns = 1000000000;
 
-    // Submit command buffer to queue, wait for completion
-    VkSubmitInfo submitInfo {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &commandBuffer
-    };
-    vkCheck(vkQueueSubmit(device.computeQueue, 1, &submitInfo, VK_NULL_HANDLE));
-    vkCheck(vkQueueWaitIdle(device.computeQueue));
-		
-		// Reset command pool (and all buffers in it) for next use
-    vkCheck(vkResetCommandPool(device.device, commandPool, 0));
+  uint64_t Device::timestampMask() {
+    return timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
   }
 
-  void Buffer::copy(Buffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
-    _copy(buffer, dst.buffer, len, srcOffset, dstOffset);
+  uint64_t Device::ticksToNs(uint64_t begin, uint64_t end) {
+    return uint64_t(((end - begin) & timestampMask()) * (double)properties.limits.timestampPeriod);
   }
 
-  void Buffer::store(void* src, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
-    if (deviceLocal) {
-      // Allocate staging buffer of copy size
-      VkBuffer staging;
-      VkDeviceMemory stagingMemory;
-      _createVkBuffer(&staging, &stagingMemory, len, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT); 
-
-      // Copy src region to staging buffer region
-      void* stagingPtr;
-      vkCheck(vkMapMemory(device.device, stagingMemory, 0, len, 0, &stagingPtr));
-      memcpy(stagingPtr, (char*)src + srcOffset, len);
-      vkUnmapMemory(device.device, stagingMemory);
-      
-      // Copy staging buffer region to device local buffer region
-      _copy(staging, buffer, len, 0, dstOffset);
-      
-      // Free staging buffer
-      vkFreeMemory(device.device, stagingMemory, nullptr);
-      vkDestroyBuffer(device.device, staging, nullptr);
-    } else {
-      // Map host visible buffer, copy memory, unmap
-      void* bufferPtr;
-      vkCheck(vkMapMemory(device.device, memory, dstOffset, len, 0, &bufferPtr));
-      memcpy(bufferPtr, (char*)src + srcOffset, len); 
-      vkUnmapMemory(device.device, memory);
+  void Device::calibrate() {
+    std::lock_guard<std::recursive_mutex> guard(calibrationLock);
+    if (getCalibratedTimestamps != nullptr) {
+      VkCalibratedTimestampInfoEXT infos[2] = {
+        { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, nullptr, VK_TIME_DOMAIN_DEVICE_EXT },
+        { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, nullptr, VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT }
+      };
+      uint64_t timestamps[2];
+      uint64_t maxDeviation;
+      vkCheck(getCalibratedTimestamps(device, 2, infos, timestamps, &maxDeviation));
+      calibrationTicks = timestamps[0];
+      calibrationHostNs = timestamps[1];
+      calibratedAt = hostClockNs();
+      calibrated = true;
+      return;
     }
-  }
 
-  void Buffer::load(void* dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
-    if (deviceLocal) {
-      VkBuffer staging;
-      VkDeviceMemory stagingMemory;
-      _createVkBuffer(&staging, &stagingMemory, len, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);      
-
-      // Copy device local buffer region to staging buffer region
-      _copy(buffer, staging, len, srcOffset, 0);
-      
-      // Copy staging buffer region to dst region (assumes memory allocated in dst)
-      void* stagingPtr;
-      vkCheck(vkMapMemory(device.device, stagingMemory, 0, len, 0, &stagingPtr));
-      memcpy((char*)dst + dstOffset, (char*)stagingPtr, len);
-      vkUnmapMemory(device.device, stagingMemory);
-      
-      // Free staging buffer
-      vkFreeMemory(device.device, stagingMemory, nullptr);
-      vkDestroyBuffer(device.device, staging, nullptr);
-    } else {
-      // Map host visible buffer, copy memory, unmap
-      void* bufferPtr;
-      vkCheck(vkMapMemory(device.device, memory, srcOffset, len, 0, &bufferPtr));
-      memcpy((char*)dst + dstOffset, (char*)bufferPtr, len); 
-    }
-  }
+    // Without the extension, a timestamp is written by an otherwise empty submission. It was taken somewhere
+    // between the host submitting and seeing the fence, so the midpoint of the tightest of a few tries is used.
+    VkCommandPoolCreateInfo commandPoolCreateInfo {
+      VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      nullptr,
+      0,
+      computeFamilyId
+    };
+    VkCommandPool commandPool;
+    vkCheck(vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &commandPool));
+    VkCommandBufferAllocateInfo commandBufferAI {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      nullptr,
+      commandPool,
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      1
+    };
+    VkCommandBuffer commandBuffer;
+    vkCheck(vkAllocateCommandBuffers(device, &commandBufferAI, &commandBuffer));
+    VkQueryPoolCreateInfo queryPoolCreateInfo {
+      VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      nullptr,
+      0,
+      VK_QUERY_TYPE_TIMESTAMP,
+      1
+    };
+    VkQueryPool queryPool;
+    vkCheck(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+    VkFenceCreateInfo fenceCreateInfo {
+      VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      nullptr,
+      0
+    };
+    VkFence fence;
+    vkCheck(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
 
-  void Buffer::fill(uint32_t word, uint64_t offset) {
-    // Begin command buffer, encode commands to fill buffer and staging buffer with word
     VkCommandBufferBeginInfo beginInfo {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      nullptr,
+      0,
+      nullptr
     };
     vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
-    vkCmdFillBuffer(commandBuffer, buffer, offset, size, word);
+    vkCmdResetQueryPool(commandBuffer, queryPool, 0, 1);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
     vkCheck(vkEndCommandBuffer(commandBuffer));
 
-    // Submit command buffer to queue, wait for completion
-    VkSubmitInfo submitInfo {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &commandBuffer
-    };	
-    vkCheck(vkQueueSubmit(device.computeQueue, 1, &submitInfo, VK_NULL_HANDLE));
-    vkCheck(vkQueueWaitIdle(device.computeQueue));
+    uint64_t bestWindow = UINT64_MAX;
+    for (int i = 0; i < 5; i++) {
+      uint64_t before = hostClockNs();
+      submit(commandBuffer, {}, fence);
+      vkCheck(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+      uint64_t after = hostClockNs();
+      vkCheck(vkResetFences(device, 1, &fence));
+      uint64_t ticks;
+      vkCheck(vkGetQueryPoolResults(device, queryPool, 0, 1, sizeof(ticks), &ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+      if (after - before < bestWindow) {
+        bestWindow = after - before;
+        calibrationTicks = ticks & timestampMask();
+        calibrationHostNs = before + (after - before) / 2;
+      }
+    }
+    calibratedAt = hostClockNs();
+    calibrated = true;
 
-    // Reset command pool (and all buffers in it) for next use
-    vkCheck(vkResetCommandPool(device.device, commandPool, 0));
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyQueryPool(device, queryPool, nullptr);
+    vkDestroyCommandPool(device, commandPool, nullptr);
   }
 
-  void Buffer::clear() {
-    fill(0);	
+  uint64_t Device::deviceToHostNs(uint64_t ticks) {
+    std::lock_guard<std::recursive_mutex> guard(calibrationLock);
+    if (!calibrated || hostClockNs() - calibratedAt > calibration_interval_ns) {
+      calibrate();
+    }
+    // Ticks may be on either side of the calibration point
+    uint64_t mask = timestampMask();
+    double period = properties.limits.timestampPeriod;
+    uint64_t ahead = (ticks - calibrationTicks) & mask;
+    if (ahead <= mask / 2) {
+      return calibrationHostNs + uint64_t(ahead * period);
+    }
+    return calibrationHostNs - uint64_t(((calibrationTicks - ticks) & mask) * period);
   }
 
-  // -------------------------------------------------------------------------------
-
-  // Read spv shader files
-  std::vector<uint32_t> read_spirv(const char *filename) {
-    auto fin = std::ifstream(filename, std::ios::binary | std::ios::ate);
-    if (!fin.is_open())
-    {
-      throw std::runtime_error(std::string("failed opening file ") + filename + " for reading");
+  Profiler &Device::profiler() {
+    std::lock_guard<std::mutex> guard(objectsLock);
+    if (profile == nullptr) {
+      profile = new Profiler(*this);
     }
-    const auto stream_size = unsigned(fin.tellg());
-    fin.seekg(0);
-
-    auto ret = std::vector<std::uint32_t>((stream_size + 3) / 4, 0);
-    std::copy(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>(), reinterpret_cast<char *>(ret.data()));
-    return ret;
+    return *profile;
   }
 
-  VkShaderModule initShaderModule(easyvk::Device &device, std::vector<uint32_t> spvCode) {
-    VkShaderModule shaderModule;
-    vkCheck(vkCreateShaderModule(device.device, new VkShaderModuleCreateInfo{VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0, spvCode.size() * sizeof(uint32_t), spvCode.data()}, nullptr, &shaderModule));
-
-    return shaderModule;
+  bool Device::hasTransferQueue() {
+    return transferQueue != computeQueue;
   }
-  VkShaderModule initShaderModule(easyvk::Device &device, const char *filepath) {
-    std::vector<uint32_t> code = read_spirv(filepath);
-    // Create shader module with spv code
-    return initShaderModule(device, code);
+
+  Completion Device::submit(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor, VkFence fence) {
+    return submitTo(computeQueue, computeQueueLock, computeTimeline, computeTimelineValue, transferTimeline, commandBuffer, waitFor, fence);
   }
 
-  VkDescriptorSetLayout createDescriptorSetLayout(easyvk::Device &device, uint32_t size) {
-    std::vector<VkDescriptorSetLayoutBinding> layouts;
-    // Create descriptor set with binding
-    for (uint32_t i = 0; i < size; i++) {
-      layouts.push_back(VkDescriptorSetLayoutBinding{
-        i,
-        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        1,
-        VK_SHADER_STAGE_COMPUTE_BIT
-      });
+  Completion Device::submitTransfer(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor, VkFence fence) {
+    if (!hasTransferQueue()) {
+      return submit(commandBuffer, waitFor, fence);
     }
-    // Define descriptor set layout info
-    VkDescriptorSetLayoutCreateInfo createInfo {
-      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-      nullptr,
-      VkDescriptorSetLayoutCreateFlags {},
-      size,
-      layouts.data()
-    };
-    VkDescriptorSetLayout descriptorSetLayout;
-    vkCheck(vkCreateDescriptorSetLayout(device.device, &createInfo, nullptr, &descriptorSetLayout));
-    return descriptorSetLayout;
+    return submitTo(transferQueue, transferQueueLock, transferTimeline, transferTimelineValue, computeTimeline, commandBuffer, waitFor, fence);
   }
 
-  // This function brings descriptorSet, buffers, and bufferInfo to create writeDescriptorSets,
-  // which describes a descriptor set write operation
-  void writeSets(VkDescriptorSet &descriptorSet,
-      std::vector<easyvk::Buffer> &buffers,
-      std::vector<VkWriteDescriptorSet> &writeDescriptorSets,
-      std::vector<VkDescriptorBufferInfo> &bufferInfos) {
-
-    // Define descriptor buffer info
-    for (int i = 0; i < buffers.size(); i++) {
-      bufferInfos.push_back(VkDescriptorBufferInfo {
-        buffers[i].buffer,
-        0,
-        VK_WHOLE_SIZE
-      });
+  Completion Device::submitTo(VkQueue queue, std::mutex &queueLock, VkSemaphore timeline, uint64_t &timelineValue, VkSemaphore otherTimeline,
+      VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor, VkFence fence) {
+    // Per thread scratch lists keep their capacity between calls, so steady state submission doesn't allocate
+    thread_local std::vector<VkSemaphore> waitSemaphores;
+    thread_local std::vector<uint64_t> waitValues;
+    thread_local std::vector<VkPipelineStageFlags> waitStages;
+    waitSemaphores.clear();
+    waitValues.clear();
+    waitStages.clear();
+    for (const auto &dependency : waitFor) {
+      if (dependency.semaphore != VK_NULL_HANDLE) {
+        waitSemaphores.push_back(dependency.semaphore);
+        waitValues.push_back(dependency.value);
+        waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+      }
     }
 
-    // wow this bug sucked: https://medium.com/@arpytoth/the-dangerous-pointer-to-vector-a139cc42a192
-    for (int i = 0; i < buffers.size(); i++) {
-      writeDescriptorSets.push_back(VkWriteDescriptorSet {
-        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        nullptr,
-        descriptorSet,
-        (uint32_t)i,
-        0,
-        1,
-        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        nullptr,
-        &bufferInfos[i],
-        nullptr
-      });
+    // Work the host has already seen finish on the other queue is made visible to this submission.
+    // Waiting on a value that has already been reached never stalls.
+    if (otherTimeline != timeline) {
+      uint64_t reached;
+      vkCheck(vkGetSemaphoreCounterValue(device, otherTimeline, &reached));
+      if (reached > 0) {
+        waitSemaphores.push_back(otherTimeline);
+        waitValues.push_back(reached);
+        waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+      }
     }
-  }
 
-  void Program::initialize(const char *entry_point, VkPipelineShaderStageCreateFlags pipelineFlags) {
-    descriptorSetLayout = createDescriptorSetLayout(device, buffers.size());
-
-    // Define pipeline layout info
-    VkPipelineLayoutCreateInfo createInfo {
-      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    // Signal values must reach the queue in increasing order, so they are assigned under the queue's lock
+    std::lock_guard<std::mutex> guard(queueLock);
+    uint64_t signalValue = ++timelineValue;
+    VkTimelineSemaphoreSubmitInfo timelineInfo {
+      VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
       nullptr,
-      VkPipelineLayoutCreateFlags {},
+      (uint32_t)waitValues.size(),
+      waitValues.data(),
       1,
-      &descriptorSetLayout,
-      1,
-      new VkPushConstantRange { VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes }
-    };
-
-    // Create a new pipeline layout object
-    vkCheck(vkCreatePipelineLayout(device.device, &createInfo, nullptr, &pipelineLayout));
-
-    // Define descriptor pool size
-    VkDescriptorPoolSize poolSize {
-      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-      (uint32_t)buffers.size()
-    };
-    auto descriptorSizes = std::array<VkDescriptorPoolSize, 1>({poolSize});
-
-    // Create a new descriptor pool object
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo {
-      VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, 
-      nullptr, 
-      VkDescriptorPoolCreateFlags{}, 
-      1, 
-      uint32_t(descriptorSizes.size()), 
-      descriptorSizes.data()
+      &signalValue
     };
-    vkCheck(vkCreateDescriptorPool(device.device, &descriptorPoolCreateInfo, nullptr, &descriptorPool));
-
-    // Allocate descriptor set
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo {
-      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, 
-      nullptr, 
-      descriptorPool, 
-      1, 
-      &descriptorSetLayout
+    VkSubmitInfo submitInfo {
+      VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      &timelineInfo,
+      (uint32_t)waitSemaphores.size(),
+      waitSemaphores.data(),
+      waitStages.data(),
+      1,
+      &commandBuffer,
+      1,
+      &timeline
     };
-    vkCheck(vkAllocateDescriptorSets(device.device, &descriptorSetAllocateInfo, &descriptorSet));
-
-    writeSets(descriptorSet, buffers, writeDescriptorSets, bufferInfos);
-
-    // Update contents of descriptor set object
-    vkUpdateDescriptorSets(device.device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, {});
-
-    uint32_t numSpecConstants = 3 + workgroupMemoryLengths.size();
-    std::vector<VkSpecializationMapEntry> specMap(numSpecConstants);
-    std::vector<uint32_t> specMapContent(numSpecConstants);
+    vkCheck(vkQueueSubmit(queue, 1, &submitInfo, fence));
+    return Completion { this, timeline, signalValue };
+  }
 
-    // first three specialization constants are the workgroup size
-    specMap[0] = VkSpecializationMapEntry{0, 0, sizeof(uint32_t)};
-    specMapContent[0] = workgroupSize;
-    specMap[1] = VkSpecializationMapEntry{1, 4, sizeof(uint32_t)};
-    specMapContent[1] = 1;
-    specMap[2] = VkSpecializationMapEntry{2, 8, sizeof(uint32_t)};
-    specMapContent[2] = 1;
-    // key is index, value is length
-    for (const auto &[key, value] : workgroupMemoryLengths) {
-      specMap[3 + key] = VkSpecializationMapEntry{3 + key, (3 + key) * 4, sizeof(uint32_t)};
-      specMapContent[3 + key] = value;
+  // Prefix written ahead of the driver's cache data in pipeline cache files. The driver's own header
+  // doesn't record the driver version, so it is kept here alongside the device identity.
+  typedef struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+  } PipelineCacheFileHeader;
+
+  const uint32_t pipeline_cache_file_magic = 0x434b5645; // "EVKC"
+
+  bool Device::loadPipelineCache(const std::string &path) {
+    auto fin = std::ifstream(path, std::ios::binary);
+    if (!fin.is_open()) {
+      return false;
+    }
+    PipelineCacheFileHeader header;
+    if (!fin.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+      return false;
+    }
+    if (header.magic != pipeline_cache_file_magic ||
+        header.vendorID != properties.vendorID ||
+        header.deviceID != properties.deviceID ||
+        header.driverVersion != properties.driverVersion ||
+        memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+      return false;
+    }
+    std::vector<char> data(header.dataSize);
+    if (!fin.read(data.data(), data.size())) {
+      return false;
     }
 
-    VkSpecializationInfo specInfo{numSpecConstants, specMap.data(), numSpecConstants * sizeof(uint32_t), specMapContent.data()};
+    // Check the driver's header too, in case the file was truncated or edited
+    VkPipelineCacheHeaderVersionOne driverHeader;
+    if (data.size() < sizeof(driverHeader)) {
+      return false;
+    }
+    memcpy(&driverHeader, data.data(), sizeof(driverHeader));
+    if (driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+        memcmp(driverHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+      return false;
+    }
 
-    // Define shader stage create info
-    VkPipelineShaderStageCreateInfo stageCI {
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+    VkPipelineCacheCreateInfo cacheCreateInfo {
+      VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
       nullptr,
-      pipelineFlags,
-      VK_SHADER_STAGE_COMPUTE_BIT,
-      shaderModule,
-      entry_point,
-      &specInfo
+      0,
+      data.size(),
+      data.data()
     };
+    VkPipelineCache loaded;
+    vkCheck(vkCreatePipelineCache(device, &cacheCreateInfo, nullptr, &loaded));
+    vkCheck(vkMergePipelineCaches(device, pipelineCache, 1, &loaded));
+    vkDestroyPipelineCache(device, loaded, nullptr);
+    return true;
+  }
 
-    // Define compute pipeline create info
-    VkComputePipelineCreateInfo pipelineCI {
-      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-      nullptr,
+  void Device::savePipelineCache(const std::string &path) {
+    size_t dataSize;
+    vkCheck(vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr));
+    std::vector<char> data(dataSize);
+    vkCheck(vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()));
+
+    PipelineCacheFileHeader header {
+      pipeline_cache_file_magic,
+      properties.vendorID,
+      properties.deviceID,
+      properties.driverVersion,
       {},
-      stageCI,
-      pipelineLayout
+      dataSize
     };
+    memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
 
-    // Create compute pipelines
-    vkCheck(vkCreateComputePipelines(device.device, {}, 1, &pipelineCI, nullptr, &pipeline));
+    auto fout = std::ofstream(path, std::ios::binary | std::ios::trunc);
+    if (!fout.is_open()) {
+      throw std::runtime_error("failed opening file " + path + " for writing");
+    }
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fout.write(data.data(), dataSize);
+  }
 
-    // Create fence.
-    vkCheck(vkCreateFence(
-        device.device,
-        new VkFenceCreateInfo {
-            VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            nullptr,
-            0},
+  void Device::retire() {
+    StagingRing *ring;
+    {
+      std::lock_guard<std::mutex> guard(objectsLock);
+      ring = staging;
+    }
+    if (ring != nullptr) {
+      ring->reclaim();
+    }
+    auto threadPool = threadTransferPools.pools.find(transfers.get());
+    if (threadPool != threadTransferPools.pools.end()) {
+      threadPool->second.second->recycle();
+    }
+  }
+
+  void Device::teardown() {
+    // Let in flight transfers finish so their readbacks land before anything is destroyed
+    vkCheck(vkDeviceWaitIdle(device));
+    retire();
+    if (profile != nullptr) {
+      profile->teardown();
+      delete profile;
+      profile = nullptr;
+    }
+    {
+      // Threads that are still running find the registry closed when they exit
+      std::lock_guard<std::mutex> guard(transfers->lock);
+      for (auto pool : transfers->pools) {
+        pool->teardown();
+        delete pool;
+      }
+      transfers->pools.clear();
+      transfers->open = false;
+    }
+    if (staging != nullptr) {
+      staging->teardown();
+      delete staging;
+      staging = nullptr;
+    }
+    if (arena != nullptr) {
+      arena->teardown();
+      delete arena;
+      arena = nullptr;
+    }
+    if (layouts != nullptr) {
+      layouts->teardown();
+      delete layouts;
+      layouts = nullptr;
+    }
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
+    if (hasTransferQueue()) {
+      vkDestroySemaphore(device, transferTimeline, nullptr);
+    }
+    vkDestroySemaphore(device, computeTimeline, nullptr);
+    vkDestroyDevice(device, nullptr);
+  }
+
+  // Checks whether a completion's timeline has been reached without doing any deferred host work
+  bool signaled(const Completion &completion) {
+    if (completion.semaphore == VK_NULL_HANDLE) {
+      return true;
+    }
+    uint64_t value;
+    vkCheck(vkGetSemaphoreCounterValue(completion.device->device, completion.semaphore, &value));
+    return value >= completion.value;
+  }
+
+  bool Completion::done() {
+    if (!signaled(*this)) {
+      return false;
+    }
+    if (device != nullptr) {
+      device->retire();
+    }
+    return true;
+  }
+
+  void Completion::wait() {
+    if (semaphore == VK_NULL_HANDLE) {
+      return;
+    }
+    VkSemaphoreWaitInfo waitInfo {
+      VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      nullptr,
+      0,
+      1,
+      &semaphore,
+      &value
+    };
+    vkCheck(vkWaitSemaphores(device->device, &waitInfo, UINT64_MAX));
+    device->retire();
+  }
+
+  // Buffers are shared concurrently between the compute and transfer queue families when they differ,
+  // so data moved on one queue is usable on the other without a queue family ownership transfer
+  void shareAcrossQueues(Device &device, VkBufferCreateInfo &bufferInfo, std::array<uint32_t, 2> &queueFamilies) {
+    if (device.transferFamilyId != device.computeFamilyId) {
+      queueFamilies = { device.computeFamilyId, device.transferFamilyId };
+      bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+      bufferInfo.queueFamilyIndexCount = 2;
+      bufferInfo.pQueueFamilyIndices = queueFamilies.data();
+    }
+  }
+
+  // Creates a VkBuffer backed by its own memory allocation with the given properties,
+  // returning the index of the memory type that was allocated from
+  uint32_t createVkBuffer(Device &device, VkBuffer* buf, VkDeviceMemory* mem, uint64_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props) {
+    // Creating VkBuffer    
+    VkBufferCreateInfo bufferInfo {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    std::array<uint32_t, 2> queueFamilies;
+    shareAcrossQueues(device, bufferInfo, queueFamilies);
+    vkCheck(vkCreateBuffer(device.device, &bufferInfo, nullptr, buf));
+    
+    // Allocating memory to it
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(device.device, *buf, &memReqs);
+    VkMemoryAllocateInfo allocInfo {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = memReqs.size,
+      .memoryTypeIndex = device.selectMemory(memReqs.memoryTypeBits, props)
+    }; 
+    vkCheck(vkAllocateMemory(device.device, &allocInfo, nullptr, mem));
+    vkCheck(vkBindBufferMemory(device.device, *buf, *mem, 0));
+    return allocInfo.memoryTypeIndex;
+  }
+
+// -------------------------------------------------------------------------------
+
+  // Chained into memory allocations so buffers placed in them can be used through device addresses
+  const VkMemoryAllocateFlagsInfo device_address_flags {
+    VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
+    nullptr,
+    VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
+    0
+  };
+
+  MemoryArena::MemoryArena(Device &_device, uint64_t _blockSize) : device(_device) {
+    // Buddy placement needs a power of two block made of power of two minimum placements
+    blockSize = min_suballocation_bytes;
+    maxOrder = 0;
+    while (blockSize < _blockSize) {
+      blockSize <<= 1;
+      maxOrder++;
+    }
+  }
+
+  uint32_t MemoryArena::newBlock(uint32_t memoryType) {
+    MemoryBlock block {};
+    block.memoryType = memoryType;
+    block.freeLists.resize(maxOrder + 1);
+    block.freeLists[maxOrder].insert(0);
+
+    // Any buffer placed in the block may ask for its device address
+    VkMemoryAllocateInfo allocInfo {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .pNext = device.supportsBufferDeviceAddress ? &device_address_flags : nullptr,
+      .allocationSize = blockSize,
+      .memoryTypeIndex = memoryType
+    };
+    vkCheck(vkAllocateMemory(device.device, &allocInfo, nullptr, &block.memory));
+
+    block.mapped = nullptr;
+    if (device.memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      void* ptr;
+      vkCheck(vkMapMemory(device.device, block.memory, 0, VK_WHOLE_SIZE, 0, &ptr));
+      block.mapped = (char*)ptr;
+    }
+
+    // Reuse a slot left behind by trim() so block indices held by live allocations stay valid
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+      if (blocks[i].memory == VK_NULL_HANDLE) {
+        blocks[i] = block;
+        return i;
+      }
+    }
+    blocks.push_back(block);
+    return blocks.size() - 1;
+  }
+
+  Allocation MemoryArena::allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags flags) {
+    std::lock_guard<std::mutex> guard(lock);
+    Allocation allocation;
+    allocation.size = requirements.size;
+    allocation.memoryType = device.selectMemory(requirements.memoryTypeBits, flags);
+    if (allocation.memoryType == uint32_t(-1)) {
+      throw std::runtime_error("no memory type supports the requested buffer properties");
+    }
+    VkMemoryPropertyFlags typeFlags = device.memoryProperties.memoryTypes[allocation.memoryType].propertyFlags;
+
+    // Non coherent placements are kept atom aligned so flushing one never touches its neighbours
+    uint64_t alignment = requirements.alignment;
+    if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+        && device.properties.limits.nonCoherentAtomSize > alignment) {
+      alignment = device.properties.limits.nonCoherentAtomSize;
+    }
+
+    // Allocations that can't fit in a block get their own memory
+    uint64_t needed = requirements.size > alignment ? requirements.size : alignment;
+    if (needed > blockSize) {
+      VkMemoryAllocateInfo allocInfo {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = device.supportsBufferDeviceAddress ? &device_address_flags : nullptr,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex = allocation.memoryType
+      };
+      vkCheck(vkAllocateMemory(device.device, &allocInfo, nullptr, &allocation.memory));
+      if (typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void* ptr;
+        vkCheck(vkMapMemory(device.device, allocation.memory, 0, VK_WHOLE_SIZE, 0, &ptr));
+        allocation.mapped = (char*)ptr;
+      }
+      dedicatedCount++;
+      dedicatedBytes += requirements.size;
+      return allocation;
+    }
+
+    // Buddy placements are aligned to their own size, which covers any power of two alignment
+    uint32_t order = 0;
+    while ((min_suballocation_bytes << order) < needed) {
+      order++;
+    }
+
+    // Find the smallest free placement of at least this order in a block of the right memory type
+    uint32_t blockIndex = uint32_t(-1);
+    uint32_t found = maxOrder + 1;
+    for (uint32_t i = 0; i < blocks.size() && found != order; i++) {
+      if (blocks[i].memory == VK_NULL_HANDLE || blocks[i].memoryType != allocation.memoryType) {
+        continue;
+      }
+      for (uint32_t o = order; o < found; o++) {
+        if (!blocks[i].freeLists[o].empty()) {
+          blockIndex = i;
+          found = o;
+          break;
+        }
+      }
+    }
+    if (blockIndex == uint32_t(-1)) {
+      blockIndex = newBlock(allocation.memoryType);
+      found = maxOrder;
+    }
+    MemoryBlock &block = blocks[blockIndex];
+
+    // Split the placement down to the requested order, returning the upper halves to the free lists
+    uint64_t offset = *block.freeLists[found].begin();
+    block.freeLists[found].erase(block.freeLists[found].begin());
+    while (found > order) {
+      found--;
+      block.freeLists[found].insert(offset + (min_suballocation_bytes << found));
+    }
+    block.live[offset] = order;
+    block.usedBytes += min_suballocation_bytes << order;
+    block.requestedBytes += requirements.size;
+
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.block = blockIndex;
+    if (block.mapped != nullptr) {
+      allocation.mapped = block.mapped + offset;
+    }
+    return allocation;
+  }
+
+  void MemoryArena::free(Allocation &allocation) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (allocation.memory == VK_NULL_HANDLE) {
+      return;
+    }
+    if (allocation.block == uint32_t(-1)) {
+      vkFreeMemory(device.device, allocation.memory, nullptr);
+      dedicatedCount--;
+      dedicatedBytes -= allocation.size;
+      allocation.memory = VK_NULL_HANDLE;
+      return;
+    }
+
+    MemoryBlock &block = blocks[allocation.block];
+    uint64_t offset = allocation.offset;
+    uint32_t order = block.live[offset];
+    block.live.erase(offset);
+    block.usedBytes -= min_suballocation_bytes << order;
+    block.requestedBytes -= allocation.size;
+
+    // Merge with free buddies as far up as possible
+    while (order < maxOrder) {
+      uint64_t buddy = offset ^ (min_suballocation_bytes << order);
+      auto it = block.freeLists[order].find(buddy);
+      if (it == block.freeLists[order].end()) {
+        break;
+      }
+      block.freeLists[order].erase(it);
+      offset = offset < buddy ? offset : buddy;
+      order++;
+    }
+    block.freeLists[order].insert(offset);
+    allocation.memory = VK_NULL_HANDLE;
+  }
+
+  MemoryStats MemoryArena::stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    MemoryStats stats {};
+    uint64_t freeBytes = 0;
+    for (auto &block : blocks) {
+      if (block.memory == VK_NULL_HANDLE) {
+        continue;
+      }
+      stats.blockCount++;
+      stats.allocationCount += block.live.size();
+      stats.reservedBytes += blockSize;
+      stats.usedBytes += block.usedBytes;
+      stats.requestedBytes += block.requestedBytes;
+      freeBytes += blockSize - block.usedBytes;
+      for (uint32_t o = maxOrder + 1; o-- > 0;) {
+        if (!block.freeLists[o].empty()) {
+          uint64_t largest = min_suballocation_bytes << o;
+          if (largest > stats.largestFreeBytes) {
+            stats.largestFreeBytes = largest;
+          }
+          break;
+        }
+      }
+    }
+    stats.dedicatedCount = dedicatedCount;
+    stats.dedicatedBytes = dedicatedBytes;
+    if (stats.reservedBytes > 0) {
+      stats.utilization = float(stats.usedBytes) / float(stats.reservedBytes);
+    }
+    if (freeBytes > 0) {
+      stats.fragmentation = 1.0f - float(stats.largestFreeBytes) / float(freeBytes);
+    }
+    return stats;
+  }
+
+  void MemoryArena::trim() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &block : blocks) {
+      if (block.memory != VK_NULL_HANDLE && block.live.empty()) {
+        vkFreeMemory(device.device, block.memory, nullptr);
+        block.memory = VK_NULL_HANDLE;
+      }
+    }
+  }
+
+  void MemoryArena::teardown() {
+    for (auto &block : blocks) {
+      if (block.memory != VK_NULL_HANDLE) {
+        vkFreeMemory(device.device, block.memory, nullptr);
+      }
+    }
+    blocks.clear();
+  }
+
+// -------------------------------------------------------------------------------
+
+  LayoutCache::LayoutCache(Device &_device) : device(_device) {}
+
+  VkDescriptorSetLayout LayoutCache::descriptorSetLayout(const std::vector<VkDescriptorType> &types, bool pushDescriptors) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = setLayouts.find({types, pushDescriptors});
+    if (found != setLayouts.end()) {
+      return found->second;
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> layouts;
+    // Create descriptor set with binding
+    for (uint32_t i = 0; i < types.size(); i++) {
+      layouts.push_back(VkDescriptorSetLayoutBinding{
+        i,
+        types[i],
+        1,
+        VK_SHADER_STAGE_COMPUTE_BIT
+      });
+    }
+    // Define descriptor set layout info
+    VkDescriptorSetLayoutCreateInfo createInfo {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      nullptr,
+      pushDescriptors ? VkDescriptorSetLayoutCreateFlags(VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR) : VkDescriptorSetLayoutCreateFlags {},
+      (uint32_t)layouts.size(),
+      layouts.data()
+    };
+    VkDescriptorSetLayout setLayout;
+    vkCheck(vkCreateDescriptorSetLayout(device.device, &createInfo, nullptr, &setLayout));
+    setLayouts[{types, pushDescriptors}] = setLayout;
+    setLayoutTypes[setLayout] = types;
+    return setLayout;
+  }
+
+  VkPipelineLayout LayoutCache::pipelineLayout(VkDescriptorSetLayout setLayout, uint32_t pushConstantBytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = pipelineLayouts.find({setLayout, pushConstantBytes});
+    if (found != pipelineLayouts.end()) {
+      return found->second;
+    }
+
+    VkPushConstantRange pushConstantRange { VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantBytes };
+    VkPipelineLayoutCreateInfo createInfo {
+      VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      nullptr,
+      VkPipelineLayoutCreateFlags {},
+      setLayout != VK_NULL_HANDLE ? 1u : 0u,
+      setLayout != VK_NULL_HANDLE ? &setLayout : nullptr,
+      pushConstantBytes > 0 ? 1u : 0u,
+      pushConstantBytes > 0 ? &pushConstantRange : nullptr
+    };
+    VkPipelineLayout layout;
+    vkCheck(vkCreatePipelineLayout(device.device, &createInfo, nullptr, &layout));
+    pipelineLayouts[{setLayout, pushConstantBytes}] = layout;
+    return layout;
+  }
+
+  VkDescriptorPool LayoutCache::newPool(const std::vector<VkDescriptorType> &types, uint32_t count) {
+    // Room for descriptor_pool_sets sets of up to 8 buffers, or for this request if it is bigger
+    std::map<VkDescriptorType, uint32_t> needed;
+    for (auto type : types) {
+      needed[type] += count;
+    }
+    uint32_t sets = std::max(descriptor_pool_sets, count);
+    std::vector<VkDescriptorPoolSize> descriptorSizes;
+    for (auto type : {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC}) {
+      descriptorSizes.push_back(VkDescriptorPoolSize{type, std::max(descriptor_pool_sets * 8, needed[type])});
+    }
+
+    // Sets are freed individually when their program is torn down
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, 
+      nullptr, 
+      VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, 
+      sets, 
+      uint32_t(descriptorSizes.size()), 
+      descriptorSizes.data()
+    };
+    VkDescriptorPool pool;
+    vkCheck(vkCreateDescriptorPool(device.device, &descriptorPoolCreateInfo, nullptr, &pool));
+    pools.push_back(pool);
+    return pool;
+  }
+
+  VkDescriptorPool LayoutCache::allocate(VkDescriptorSetLayout setLayout, uint32_t count, VkDescriptorSet *sets) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<VkDescriptorSetLayout> setLayouts(count, setLayout);
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo {
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, 
+      nullptr, 
+      VK_NULL_HANDLE, 
+      count, 
+      setLayouts.data()
+    };
+
+    // Newest pools are the most likely to have room
+    for (auto pool = pools.rbegin(); pool != pools.rend(); pool++) {
+      descriptorSetAllocateInfo.descriptorPool = *pool;
+      VkResult result = vkAllocateDescriptorSets(device.device, &descriptorSetAllocateInfo, sets);
+      if (result == VK_SUCCESS) {
+        return *pool;
+      }
+      if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) {
+        vkCheck(result);
+      }
+    }
+    descriptorSetAllocateInfo.descriptorPool = newPool(setLayoutTypes.at(setLayout), count);
+    vkCheck(vkAllocateDescriptorSets(device.device, &descriptorSetAllocateInfo, sets));
+    return descriptorSetAllocateInfo.descriptorPool;
+  }
+
+  void LayoutCache::free(VkDescriptorPool pool, const std::vector<VkDescriptorSet> &sets) {
+    std::lock_guard<std::mutex> guard(lock);
+    vkCheck(vkFreeDescriptorSets(device.device, pool, sets.size(), sets.data()));
+  }
+
+  void LayoutCache::teardown() {
+    for (const auto &[signature, layout] : pipelineLayouts) {
+      vkDestroyPipelineLayout(device.device, layout, nullptr);
+    }
+    for (const auto &[signature, layout] : setLayouts) {
+      vkDestroyDescriptorSetLayout(device.device, layout, nullptr);
+    }
+    // Destroying a pool frees every set still allocated from it
+    for (auto pool : pools) {
+      vkDestroyDescriptorPool(device.device, pool, nullptr);
+    }
+    pipelineLayouts.clear();
+    setLayouts.clear();
+    setLayoutTypes.clear();
+    pools.clear();
+  }
+
+// -------------------------------------------------------------------------------
+
+  StagingRing::StagingRing(Device &_device, uint64_t sizeBytes) : size(sizeBytes), device(_device), head(0) {
+    // Coherent memory so staged data never needs explicit flushes or invalidations
+    createVkBuffer(device, &buffer, &memory, size,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    // Mapped once for the lifetime of the ring
+    void* ptr;
+    vkCheck(vkMapMemory(device.device, memory, 0, VK_WHOLE_SIZE, 0, &ptr));
+    mapped = (char*)ptr;
+  }
+
+  uint64_t StagingRing::acquire(uint64_t len, uint64_t &granted) {
+    // Transfers larger than the ring are streamed in half ring chunks, so staging one chunk
+    // overlaps with the copy of the previous one
+    granted = len <= size ? len : size / 2;
+    uint64_t alignment = device.properties.limits.optimalBufferCopyOffsetAlignment;
+    if (alignment == 0) {
+      alignment = 1;
+    }
+
+    std::unique_lock<std::recursive_mutex> guard(lock);
+    while (true) {
+      reclaim();
+      uint64_t offset = uint64_t(-1);
+      if (regions.empty()) {
+        offset = 0;
+      } else {
+        // Live regions run from tail up to head, possibly wrapping around the end of the ring
+        uint64_t tail = regions.front().begin;
+        uint64_t start = (head + alignment - 1) / alignment * alignment;
+        if (head > tail) {
+          if (start + granted <= size) {
+            offset = start;
+          } else if (granted <= tail) {
+            offset = 0;
+          }
+        } else if (head < tail && start + granted <= tail) {
+          offset = start;
+        }
+      }
+      if (offset != uint64_t(-1)) {
+        regions.push_back(StagingRegion { offset, offset + granted, false, Completion(), nullptr, std::this_thread::get_id() });
+        head = offset + granted;
+        return offset;
+      }
+
+      // Out of space, wait for the oldest region to be handed to its transfer
+      if (!regions.front().submitted) {
+        if (regions.front().owner == std::this_thread::get_id()) {
+          throw std::runtime_error("staging ring exhausted by regions that were never released");
+        }
+        released.wait(guard);
+        continue;
+      }
+      // Then for the transfer to give it back, without holding up other threads meanwhile
+      Completion oldest = regions.front().completion;
+      guard.unlock();
+      oldest.wait();
+      guard.lock();
+    }
+  }
+
+  void StagingRing::release(uint64_t offset, Completion completion, char *readback) {
+    {
+      std::lock_guard<std::recursive_mutex> guard(lock);
+      // Live regions don't overlap, so the offset identifies the region
+      auto region = std::find_if(regions.rbegin(), regions.rend(), [&](const StagingRegion &r) { return r.begin == offset && !r.submitted; });
+      if (region == regions.rend()) {
+        throw std::runtime_error("releasing staging region " + std::to_string(offset) + " that wasn't acquired");
+      }
+      region->submitted = true;
+      region->completion = completion;
+      region->readback = readback;
+    }
+    released.notify_all();
+  }
+
+  void StagingRing::reclaim() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    // Readbacks land as soon as their transfer completes, even behind a region another thread hasn't
+    // released yet, so a completed loadAsync never leaves stale data in its destination
+    for (auto &region : regions) {
+      if (region.submitted && region.readback != nullptr && signaled(region.completion)) {
+        memcpy(region.readback, mapped + region.begin, region.end - region.begin);
+        region.readback = nullptr;
+      }
+    }
+    // Space is only freed from the front, so the live regions stay contiguous
+    while (!regions.empty() && regions.front().submitted && signaled(regions.front().completion)) {
+      regions.pop_front();
+    }
+    if (regions.empty()) {
+      head = 0;
+    }
+  }
+
+  void StagingRing::teardown() {
+    vkUnmapMemory(device.device, memory);
+    vkFreeMemory(device.device, memory, nullptr);
+    vkDestroyBuffer(device.device, buffer, nullptr);
+  }
+
+// -------------------------------------------------------------------------------
+
+  TransferPool::TransferPool(Device &_device) : device(_device) {
+    // Command buffers are reset one at a time as they are recycled
+    VkCommandPoolCreateInfo commandPoolCreateInfo {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      .queueFamilyIndex = device.transferFamilyId
+    };
+    vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+  }
+
+  VkCommandBuffer TransferPool::begin() {
+    recycle();
+    VkCommandBuffer commandBuffer;
+    if (available.empty()) {
+      VkCommandBufferAllocateInfo commandBufferAllocInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1
+      };
+      vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAllocInfo, &commandBuffer));
+    } else {
+      commandBuffer = available.back();
+      available.pop_back();
+    }
+
+    // Beginning a recycled command buffer implicitly resets it
+    VkCommandBufferBeginInfo beginInfo {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    };
+    vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    return commandBuffer;
+  }
+
+  Completion TransferPool::submit(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor) {
+    vkCheck(vkEndCommandBuffer(commandBuffer));
+    Completion completion = device.submitTransfer(commandBuffer, waitFor);
+    inFlight.push_back({ completion, commandBuffer });
+    return completion;
+  }
+
+  void TransferPool::recycle() {
+    while (!inFlight.empty() && signaled(inFlight.front().first)) {
+      available.push_back(inFlight.front().second);
+      inFlight.pop_front();
+    }
+  }
+
+  void TransferPool::teardown() {
+    // Pending command buffers can't be freed. Transfers signal the timeline in submission order, so waiting
+    // for the last one covers the rest. This doesn't retire, since the pool may be freed as its thread exits.
+    if (!inFlight.empty()) {
+      const Completion &last = inFlight.back().first;
+      VkSemaphoreWaitInfo waitInfo {
+        VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        nullptr,
+        0,
+        1,
+        &last.semaphore,
+        &last.value
+      };
+      vkCheck(vkWaitSemaphores(device.device, &waitInfo, UINT64_MAX));
+    }
+    // Destroying the pool frees every command buffer allocated from it
+    vkDestroyCommandPool(device.device, commandPool, nullptr);
+  }
+
+
+// -------------------------------------------------------------------------------
+
+  Buffer::Buffer(Device &device, uint64_t sizeBytes, bool deviceLocal) : device(device), size(sizeBytes), deviceLocal(deviceLocal) {
+    _create(nullptr);
+    _place(deviceLocal ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  }
+
+  Buffer::Buffer(Device &device, void *hostPointer, uint64_t sizeBytes) : device(device), size(sizeBytes), deviceLocal(false) {
+    uint64_t alignment = device.minImportedHostPointerAlignment;
+    uint32_t importableTypes = 0;
+    if (device.supportsHostImport && alignment != 0 && (uintptr_t)hostPointer % alignment == 0 && sizeBytes % alignment == 0) {
+      importableTypes = device.hostPointerMemoryTypes(hostPointer);
+    }
+
+    if (importableTypes != 0) {
+      VkExternalMemoryBufferCreateInfo externalInfo {
+        VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+        nullptr,
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT
+      };
+      _create(&externalInfo);
+      VkMemoryRequirements memReqs;
+      vkGetBufferMemoryRequirements(device.device, buffer, &memReqs);
+      uint32_t memoryType = device.selectMemory(memReqs.memoryTypeBits & importableTypes, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+      if (memoryType != uint32_t(-1) && memReqs.size <= sizeBytes) {
+        // The imported memory is a dedicated allocation that the arena never sees
+        VkImportMemoryHostPointerInfoEXT importInfo {
+          VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+          device.supportsBufferDeviceAddress ? &device_address_flags : nullptr,
+          VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+          hostPointer
+        };
+        VkMemoryAllocateInfo allocateInfo {
+          VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+          &importInfo,
+          sizeBytes,
+          memoryType
+        };
+        vkCheck(vkAllocateMemory(device.device, &allocateInfo, nullptr, &memory));
+        vkCheck(vkBindBufferMemory(device.device, buffer, memory, 0));
+        allocation.memory = memory;
+        allocation.size = sizeBytes;
+        allocation.memoryType = memoryType;
+        allocation.mapped = (char*)hostPointer;
+        mapped = allocation.mapped;
+        coherent = device.memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        imported = true;
+        return;
+      }
+      vkDestroyBuffer(device.device, buffer, nullptr);
+    }
+
+    // Can't alias this memory, so hold a copy in an ordinary host visible buffer
+    _create(nullptr);
+    _place(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    store(hostPointer, sizeBytes);
+  }
+
+  void Buffer::_create(const void *pNext) {
+    VkBufferUsageFlags usage = 
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT 
+      | VK_BUFFER_USAGE_TRANSFER_DST_BIT 
+      | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+      | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+    if (device.supportsBufferDeviceAddress) {
+      usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    }
+    VkBufferCreateInfo bufferInfo {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext = pNext,
+      .size = size,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    std::array<uint32_t, 2> queueFamilies;
+    shareAcrossQueues(device, bufferInfo, queueFamilies);
+    vkCheck(vkCreateBuffer(device.device, &bufferInfo, nullptr, &buffer));
+  }
+
+  void Buffer::_place(VkMemoryPropertyFlags memProp) {
+    // Place the buffer in one of the device's memory blocks
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(device.device, buffer, &memReqs);
+    allocation = device.memoryArena().allocate(memReqs, memProp);
+    vkCheck(vkBindBufferMemory(device.device, buffer, allocation.memory, allocation.offset));
+    memory = allocation.memory;
+
+    // Host visible blocks are mapped once for their lifetime
+    mapped = allocation.mapped;
+    coherent = device.memoryProperties.memoryTypes[allocation.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  }
+
+  void Buffer::_createVkBuffer(VkBuffer* buf, VkDeviceMemory* mem, uint64_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props) {
+    createVkBuffer(device, buf, mem, size, usage, props);
+  }
+
+  void Buffer::teardown() {
+    if (imported) {
+      vkFreeMemory(device.device, memory, nullptr);
+    } else {
+      device.memoryArena().free(allocation);
+    }
+    vkDestroyBuffer(device.device, buffer, nullptr);
+  }
+
+  // Orders a transfer after earlier work on the queue
+  void memoryBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess,
+      VkPipelineStageFlags dstStages, VkAccessFlags dstAccess) {
+    VkMemoryBarrier barrier {
+      VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      nullptr,
+      srcAccess,
+      dstAccess
+    };
+    vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  }
+
+  void transferBarrierBefore(VkCommandBuffer commandBuffer) {
+    VkMemoryBarrier barrier {
+      VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      nullptr,
+      VK_ACCESS_MEMORY_WRITE_BIT,
+      VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+  }
+
+  // Makes a transfer's writes visible to later work on the queue and to the host
+  void transferBarrierAfter(VkCommandBuffer commandBuffer) {
+    VkMemoryBarrier barrier {
+      VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      nullptr,
+      VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_HOST_READ_BIT
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+  }
+
+  void Buffer::_copy(VkBuffer src, VkBuffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
+    // Records into the device's transfer command buffers, which are recycled once this completes
+    _copyAsync(src, dst, len, srcOffset, dstOffset, {}).wait();
+  }
+
+  Completion Buffer::_copyAsync(VkBuffer src, VkBuffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset, const std::vector<Completion> &waitFor) {
+    TransferPool &pool = device.transferPool();
+    VkCommandBuffer commandBuffer = pool.begin();
+    VkBufferCopy copyRegion {
+      .srcOffset = srcOffset,
+      .dstOffset = dstOffset,
+      .size = len
+    };
+    transferBarrierBefore(commandBuffer);
+    vkCmdCopyBuffer(commandBuffer, src, dst, 1, &copyRegion);
+    transferBarrierAfter(commandBuffer);
+    return pool.submit(commandBuffer, waitFor);
+  }
+
+  void Buffer::copy(Buffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
+    _copy(buffer, dst.buffer, len, srcOffset, dstOffset);
+  }
+
+  void Buffer::store(void* src, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
+    if (deviceLocal) {
+      // Stream src through the device's staging ring, at most one ring's worth per copy
+      StagingRing &ring = device.stagingRing();
+      uint64_t done = 0;
+      while (done < len) {
+        uint64_t chunk;
+        uint64_t ringOffset = ring.acquire(len - done, chunk);
+
+        // Copy src region to staging ring region
+        memcpy(ring.mapped + ringOffset, (char*)src + srcOffset + done, chunk);
+
+        // Copy staging ring region to device local buffer region, after which the region is free again
+        _copy(ring.buffer, buffer, chunk, ringOffset, dstOffset + done);
+        ring.release(ringOffset, Completion());
+        done += chunk;
+      }
+    } else {
+      // Copy straight into the persistent mapping
+      memcpy(mapped + dstOffset, (char*)src + srcOffset, len);
+      flush(len, dstOffset);
+    }
+  }
+
+  void Buffer::load(void* dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
+    if (deviceLocal) {
+      // Stream the device local region back through the device's staging ring
+      StagingRing &ring = device.stagingRing();
+      uint64_t done = 0;
+      while (done < len) {
+        uint64_t chunk;
+        uint64_t ringOffset = ring.acquire(len - done, chunk);
+
+        // Copy device local buffer region to staging ring region
+        _copy(buffer, ring.buffer, chunk, srcOffset + done, ringOffset);
+
+        // Copy staging ring region to dst region (assumes memory allocated in dst)
+        memcpy((char*)dst + dstOffset + done, ring.mapped + ringOffset, chunk);
+        ring.release(ringOffset, Completion());
+        done += chunk;
+      }
+    } else {
+      // Copy straight out of the persistent mapping
+      invalidate(len, srcOffset);
+      memcpy((char*)dst + dstOffset, mapped + srcOffset, len);
+    }
+  }
+
+  Completion Buffer::copyAsync(Buffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset, const std::vector<Completion> &waitFor) {
+    return _copyAsync(buffer, dst.buffer, len, srcOffset, dstOffset, waitFor);
+  }
+
+  Completion Buffer::storeAsync(void* src, uint64_t len, uint64_t srcOffset, uint64_t dstOffset, const std::vector<Completion> &waitFor) {
+    if (!deviceLocal) {
+      // Host visible memory is written directly once the work it depends on has finished
+      for (auto dependency : waitFor) {
+        dependency.wait();
+      }
+      store(src, len, srcOffset, dstOffset);
+      return Completion();
+    }
+
+    StagingRing &ring = device.stagingRing();
+    Completion completion;
+    uint64_t done = 0;
+    while (done < len) {
+      uint64_t chunk;
+      uint64_t ringOffset = ring.acquire(len - done, chunk);
+      memcpy(ring.mapped + ringOffset, (char*)src + srcOffset + done, chunk);
+      // Later submissions on the queue signal later values, so the last chunk's completion covers all of them
+      completion = _copyAsync(ring.buffer, buffer, chunk, ringOffset, dstOffset + done, waitFor);
+      ring.release(ringOffset, completion);
+      done += chunk;
+    }
+    return completion;
+  }
+
+  Completion Buffer::loadAsync(void* dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset, const std::vector<Completion> &waitFor) {
+    if (!deviceLocal) {
+      // Host visible memory is read directly once the work it depends on has finished
+      for (auto dependency : waitFor) {
+        dependency.wait();
+      }
+      load(dst, len, srcOffset, dstOffset);
+      return Completion();
+    }
+
+    StagingRing &ring = device.stagingRing();
+    Completion completion;
+    uint64_t done = 0;
+    while (done < len) {
+      uint64_t chunk;
+      uint64_t ringOffset = ring.acquire(len - done, chunk);
+      completion = _copyAsync(buffer, ring.buffer, chunk, srcOffset + done, ringOffset, waitFor);
+      // The ring copies the region out to dst once the copy has completed
+      ring.release(ringOffset, completion, (char*)dst + dstOffset + done);
+      done += chunk;
+    }
+    return completion;
+  }
+
+  Completion Buffer::fillAsync(uint32_t word, uint64_t offset, const std::vector<Completion> &waitFor) {
+    TransferPool &pool = device.transferPool();
+    VkCommandBuffer commandBuffer = pool.begin();
+    transferBarrierBefore(commandBuffer);
+    vkCmdFillBuffer(commandBuffer, buffer, offset, VK_WHOLE_SIZE, word);
+    transferBarrierAfter(commandBuffer);
+    return pool.submit(commandBuffer, waitFor);
+  }
+
+  // Builds a mapped range covering [offset, offset + len) rounded out to nonCoherentAtomSize
+  VkMappedMemoryRange mappedRange(Buffer &buf, uint64_t len, uint64_t offset) {
+    uint64_t atom = buf.device.properties.limits.nonCoherentAtomSize;
+    if (atom == 0) {
+      atom = 1;
+    }
+    // Offsets are relative to the start of the memory object the buffer is placed in
+    offset += buf.allocation.offset;
+    uint64_t begin = offset / atom * atom;
+    uint64_t end = buf.allocation.offset + buf.size;
+    if (len != VK_WHOLE_SIZE && offset + len < end) {
+      end = offset + len;
+    }
+    uint64_t rangeSize = (end - begin + atom - 1) / atom * atom;
+    // Block placements are atom aligned, so only dedicated allocations can round past their end
+    if (buf.allocation.block == uint32_t(-1) && begin + rangeSize > buf.allocation.size) {
+      rangeSize = VK_WHOLE_SIZE;
+    }
+    return VkMappedMemoryRange {
+      VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+      nullptr,
+      buf.memory,
+      begin,
+      rangeSize
+    };
+  }
+
+  void Buffer::flush(uint64_t len, uint64_t offset) {
+    if (coherent || mapped == nullptr) {
+      return;
+    }
+    VkMappedMemoryRange range = mappedRange(*this, len, offset);
+    vkCheck(vkFlushMappedMemoryRanges(device.device, 1, &range));
+  }
+
+  void Buffer::invalidate(uint64_t len, uint64_t offset) {
+    if (coherent || mapped == nullptr) {
+      return;
+    }
+    VkMappedMemoryRange range = mappedRange(*this, len, offset);
+    vkCheck(vkInvalidateMappedMemoryRanges(device.device, 1, &range));
+  }
+
+  void Buffer::fill(uint32_t word, uint64_t offset) {
+    // Fills from offset to the end of the buffer
+    fillAsync(word, offset).wait();
+  }
+
+  uint64_t Buffer::deviceAddress() {
+    if (!device.supportsBufferDeviceAddress) {
+      throw std::runtime_error("device does not support buffer device addresses");
+    }
+    VkBufferDeviceAddressInfo addressInfo {
+      VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+      nullptr,
+      buffer
+    };
+    return vkGetBufferDeviceAddress(device.device, &addressInfo);
+  }
+
+  void Buffer::clear() {
+    fill(0);	
+  }
+
+  // -------------------------------------------------------------------------------
+
+  BufferView::BufferView(Buffer &buffer) : BufferView(buffer, 0) {}
+
+  BufferView::BufferView(Buffer &_buffer, uint64_t _offset, uint64_t _range, bool _dynamic) : buffer(_buffer.buffer),
+                                                                                              bufferSize(_buffer.size),
+                                                                                              offset(_offset),
+                                                                                              range(_range),
+                                                                                              dynamic(_dynamic) {
+    uint64_t alignment = _buffer.device.properties.limits.minStorageBufferOffsetAlignment;
+    if (alignment != 0 && offset % alignment != 0) {
+      throw std::runtime_error("buffer view offset " + std::to_string(offset) + " is not a multiple of minStorageBufferOffsetAlignment (" +
+        std::to_string(alignment) + ")");
+    }
+    if (offset > bufferSize) {
+      throw std::runtime_error("buffer view offset " + std::to_string(offset) + " is past the end of a " + std::to_string(bufferSize) + " byte buffer");
+    }
+    if (range == VK_WHOLE_SIZE) {
+      range = bufferSize - offset;
+    }
+    if (range > bufferSize - offset) {
+      throw std::runtime_error("buffer view of " + std::to_string(range) + " bytes at offset " + std::to_string(offset) +
+        " runs past the end of a " + std::to_string(bufferSize) + " byte buffer");
+    }
+  }
+
+  // -------------------------------------------------------------------------------
+
+  // Read spv shader files
+  std::vector<uint32_t> read_spirv(const char *filename) {
+    auto fin = std::ifstream(filename, std::ios::binary | std::ios::ate);
+    if (!fin.is_open())
+    {
+      throw std::runtime_error(std::string("failed opening file ") + filename + " for reading");
+    }
+    const auto stream_size = unsigned(fin.tellg());
+    fin.seekg(0);
+
+    auto ret = std::vector<std::uint32_t>((stream_size + 3) / 4, 0);
+    std::copy(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>(), reinterpret_cast<char *>(ret.data()));
+    return ret;
+  }
+
+  VkShaderModule initShaderModule(easyvk::Device &device, std::vector<uint32_t> spvCode) {
+    VkShaderModule shaderModule;
+    VkShaderModuleCreateInfo shaderModuleCreateInfo {
+      VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+      nullptr,
+      0,
+      spvCode.size() * sizeof(uint32_t),
+      spvCode.data()
+    };
+    vkCheck(vkCreateShaderModule(device.device, &shaderModuleCreateInfo, nullptr, &shaderModule));
+
+    return shaderModule;
+  }
+
+  // 64-bit FNV-1a over the SPIR-V words, identifies a shader in tuning files
+  uint64_t hashSpirv(const std::vector<uint32_t> &spvCode) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint32_t word : spvCode) {
+      for (int i = 0; i < 4; i++) {
+        hash ^= (word >> (8 * i)) & 0xff;
+        hash *= 0x100000001b3;
+      }
+    }
+    return hash;
+  }
+
+  // SPIR-V opcodes, enumerants and decorations that reflection looks at
+  const uint32_t spv_magic = 0x07230203;
+  const uint32_t spv_op_entry_point = 15;
+  const uint32_t spv_op_execution_mode = 16;
+  const uint32_t spv_op_type_bool = 20;
+  const uint32_t spv_op_type_int = 21;
+  const uint32_t spv_op_type_float = 22;
+  const uint32_t spv_op_type_vector = 23;
+  const uint32_t spv_op_type_matrix = 24;
+  const uint32_t spv_op_type_image = 25;
+  const uint32_t spv_op_type_sampler = 26;
+  const uint32_t spv_op_type_sampled_image = 27;
+  const uint32_t spv_op_type_array = 28;
+  const uint32_t spv_op_type_runtime_array = 29;
+  const uint32_t spv_op_type_struct = 30;
+  const uint32_t spv_op_type_pointer = 32;
+  const uint32_t spv_op_constant = 43;
+  const uint32_t spv_op_constant_composite = 44;
+  const uint32_t spv_op_spec_constant = 50;
+  const uint32_t spv_op_spec_constant_composite = 51;
+  const uint32_t spv_op_function = 54;
+  const uint32_t spv_op_function_end = 56;
+  const uint32_t spv_op_function_call = 57;
+  const uint32_t spv_op_variable = 59;
+  const uint32_t spv_op_image_texel_pointer = 60;
+  const uint32_t spv_op_load = 61;
+  const uint32_t spv_op_store = 62;
+  const uint32_t spv_op_copy_memory = 63;
+  const uint32_t spv_op_copy_memory_sized = 64;
+  const uint32_t spv_op_access_chain = 65;
+  const uint32_t spv_op_in_bounds_access_chain = 66;
+  const uint32_t spv_op_ptr_access_chain = 67;
+  const uint32_t spv_op_array_length = 68;
+  const uint32_t spv_op_in_bounds_ptr_access_chain = 70;
+  const uint32_t spv_op_decorate = 71;
+  const uint32_t spv_op_member_decorate = 72;
+  const uint32_t spv_op_atomic_load = 227;
+  const uint32_t spv_op_atomic_store = 228;
+  const uint32_t spv_op_atomic_xor = 242;
+  const uint32_t spv_op_atomic_flag_test_and_set = 318;
+  const uint32_t spv_op_atomic_flag_clear = 319;
+  const uint32_t spv_op_execution_mode_id = 331;
+  const uint32_t spv_op_atomic_fmin_ext = 5614;
+  const uint32_t spv_op_atomic_fmax_ext = 5615;
+  const uint32_t spv_op_atomic_fadd_ext = 6035;
+  const uint32_t spv_execution_model_gl_compute = 5;
+  const uint32_t spv_execution_model_kernel = 6;
+  const uint32_t spv_execution_mode_local_size = 17;
+  const uint32_t spv_execution_mode_local_size_id = 38;
+  const uint32_t spv_decoration_spec_id = 1;
+  const uint32_t spv_decoration_buffer_block = 3;
+  const uint32_t spv_decoration_array_stride = 6;
+  const uint32_t spv_decoration_builtin = 11;
+  const uint32_t spv_decoration_binding = 33;
+  const uint32_t spv_decoration_descriptor_set = 34;
+  const uint32_t spv_decoration_offset = 35;
+  const uint32_t spv_builtin_workgroup_size = 25;
+  const uint32_t spv_storage_uniform_constant = 0;
+  const uint32_t spv_storage_uniform = 2;
+  const uint32_t spv_storage_workgroup = 4;
+  const uint32_t spv_storage_push_constant = 9;
+  const uint32_t spv_storage_storage_buffer = 12;
+  const uint32_t spv_dim_buffer = 5;
+
+  // Everything reflectSpirv collects in its single pass over a module
+  typedef struct SpirvModule {
+    // Type and constant instructions by result id, holding the words after the result id
+    std::map<uint32_t, std::pair<uint32_t, std::vector<uint32_t>>> types;
+    std::map<uint32_t, uint32_t> constants;
+    std::map<uint32_t, std::vector<uint32_t>> composites;
+    std::map<uint32_t, std::pair<uint32_t, uint32_t>> variables; // pointer type and storage class
+    std::map<uint32_t, std::map<uint32_t, uint32_t>> decorations; // id -> decoration -> first literal
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> memberOffsets;
+    // Functions each function's body calls and pointers it accesses, see functionReferences
+    std::map<uint32_t, std::set<uint32_t>> functionRefs;
+  } SpirvModule;
+
+  bool decorated(const SpirvModule &module, uint32_t id, uint32_t decoration, uint32_t *value = nullptr) {
+    auto found = module.decorations.find(id);
+    if (found == module.decorations.end()) {
+      return false;
+    }
+    auto literal = found->second.find(decoration);
+    if (literal == found->second.end()) {
+      return false;
+    }
+    if (value != nullptr) {
+      *value = literal->second;
+    }
+    return true;
+  }
+
+  // Adds the ids a function body instruction uses as a callee or as a pointer it accesses, which is how
+  // a function reaches global variables. Literal and value operands are skipped, since they can collide
+  // with the ids of unrelated variables.
+  void functionReferences(uint32_t op, const uint32_t *words, uint32_t wordCount, std::set<uint32_t> &refs) {
+    // Malformed instructions may be too short for the operand
+    auto reference = [&](uint32_t operand) {
+      if (operand < wordCount) {
+        refs.insert(words[operand]);
+      }
+    };
+    switch (op) {
+      case spv_op_function_call:
+        // The callee, and pointers passed as arguments
+        for (uint32_t operand = 3; operand < wordCount; operand++) {
+          reference(operand);
+        }
+        break;
+      case spv_op_store:
+      case spv_op_atomic_store:
+      case spv_op_atomic_flag_clear:
+        reference(1);
+        break;
+      case spv_op_copy_memory:
+      case spv_op_copy_memory_sized:
+        reference(1);
+        reference(2);
+        break;
+      case spv_op_image_texel_pointer:
+      case spv_op_load:
+      case spv_op_access_chain:
+      case spv_op_in_bounds_access_chain:
+      case spv_op_ptr_access_chain:
+      case spv_op_in_bounds_ptr_access_chain:
+      case spv_op_array_length:
+      case spv_op_atomic_flag_test_and_set:
+      case spv_op_atomic_fmin_ext:
+      case spv_op_atomic_fmax_ext:
+      case spv_op_atomic_fadd_ext:
+        reference(3);
+        break;
+      default:
+        // The remaining atomics all take the pointer after the result type and id
+        if (op >= spv_op_atomic_load && op <= spv_op_atomic_xor) {
+          reference(3);
+        }
+    }
+  }
+
+  // Bytes a value of the type occupies, following explicit offsets and strides where the shader gives them
+  uint64_t spirvTypeSize(const SpirvModule &module, uint32_t typeId) {
+    auto found = module.types.find(typeId);
+    if (found == module.types.end()) {
+      return 0;
+    }
+    const auto &[op, operands] = found->second;
+    switch (op) {
+      case spv_op_type_bool:
+        return 4;
+      case spv_op_type_int:
+      case spv_op_type_float:
+        return operands[0] / 8;
+      case spv_op_type_vector:
+      case spv_op_type_matrix:
+        return operands[1] * spirvTypeSize(module, operands[0]);
+      case spv_op_type_array: {
+        uint32_t stride;
+        uint64_t elementSize = decorated(module, typeId, spv_decoration_array_stride, &stride) ? stride : spirvTypeSize(module, operands[0]);
+        auto length = module.constants.find(operands[1]);
+        return length == module.constants.end() ? 0 : elementSize * length->second;
+      }
+      case spv_op_type_struct: {
+        uint64_t size = 0;
+        for (uint32_t m = 0; m < operands.size(); m++) {
+          auto offset = module.memberOffsets.find({typeId, m});
+          uint64_t memberSize = spirvTypeSize(module, operands[m]);
+          size = offset == module.memberOffsets.end() ? size + memberSize : std::max(size, offset->second + memberSize);
+        }
+        return size;
+      }
+      case spv_op_type_pointer:
+        return 8;
+      default:
+        // Runtime arrays and opaque types have no static size
+        return 0;
+    }
+  }
+
+  VkDescriptorType spirvDescriptorType(const SpirvModule &module, uint32_t storage, uint32_t typeId, const ReflectedBinding &binding) {
+    if (storage == spv_storage_storage_buffer || (storage == spv_storage_uniform && decorated(module, typeId, spv_decoration_buffer_block))) {
+      return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    }
+    if (storage == spv_storage_uniform) {
+      return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    }
+    // Types the module scan doesn't model, e.g. acceleration structures, aren't found
+    auto type = module.types.find(typeId);
+    uint32_t op = type != module.types.end() ? type->second.first : 0;
+    if (op == spv_op_type_sampler) {
+      return VK_DESCRIPTOR_TYPE_SAMPLER;
+    }
+    if (op == spv_op_type_sampled_image) {
+      return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    }
+    // Image operands after the sampled type: dim, depth, arrayed, multisampled, sampled
+    if (op == spv_op_type_image && type->second.second.size() >= 6) {
+      const auto &operands = type->second.second;
+      bool storageImage = operands[5] == 2;
+      if (operands[1] == spv_dim_buffer) {
+        return storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+      }
+      return storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    }
+    throw std::runtime_error("binding " + std::to_string(binding.binding) + " in set " + std::to_string(binding.set) +
+      " has a type that isn't supported (SPIR-V type id " + std::to_string(typeId) + ")");
+  }
+
+  std::vector<ShaderInterface> reflectSpirv(const std::vector<uint32_t> &spvCode) {
+    if (spvCode.size() < 5 || spvCode[0] != spv_magic) {
+      throw std::runtime_error("shader is not a SPIR-V module");
+    }
+
+    SpirvModule module;
+    std::vector<ShaderInterface> interfaces;
+    std::vector<uint32_t> entryFunctions;
+    std::vector<std::vector<uint32_t>> entryInterfaceIds;
+    std::map<uint32_t, std::array<uint32_t, 3>> localSizeIds;
+    uint32_t currentFunction = 0;
+    for (size_t i = 5; i < spvCode.size();) {
+      uint32_t wordCount = spvCode[i] >> 16;
+      uint32_t op = spvCode[i] & 0xffff;
+      if (wordCount == 0 || i + wordCount > spvCode.size()) {
+        throw std::runtime_error("malformed SPIR-V instruction at word " + std::to_string(i));
+      }
+      const uint32_t *words = &spvCode[i];
+      i += wordCount;
+
+      if (currentFunction != 0) {
+        if (op == spv_op_function_end) {
+          currentFunction = 0;
+        } else {
+          functionReferences(op, words, wordCount, module.functionRefs[currentFunction]);
+        }
+        continue;
+      }
+
+      switch (op) {
+        case spv_op_entry_point: {
+          if (words[1] != spv_execution_model_gl_compute && words[1] != spv_execution_model_kernel) {
+            break;
+          }
+          ShaderInterface entry;
+          size_t nameBytes = strnlen(reinterpret_cast<const char *>(words + 3), (wordCount - 3) * sizeof(uint32_t));
+          entry.entryPoint = std::string(reinterpret_cast<const char *>(words + 3), nameBytes);
+          interfaces.push_back(entry);
+          entryFunctions.push_back(words[2]);
+          entryInterfaceIds.push_back(std::vector<uint32_t>(words + 3 + nameBytes / 4 + 1, words + wordCount));
+          break;
+        }
+        case spv_op_execution_mode:
+          if (words[2] == spv_execution_mode_local_size) {
+            for (uint32_t e = 0; e < entryFunctions.size(); e++) {
+              if (entryFunctions[e] == words[1]) {
+                interfaces[e].localSize = {words[3], words[4], words[5]};
+              }
+            }
+          }
+          break;
+        case spv_op_execution_mode_id:
+          if (words[2] == spv_execution_mode_local_size_id) {
+            localSizeIds[words[1]] = {words[3], words[4], words[5]};
+          }
+          break;
+        case spv_op_decorate:
+          module.decorations[words[1]][words[2]] = wordCount > 3 ? words[3] : 0;
+          break;
+        case spv_op_member_decorate:
+          if (words[3] == spv_decoration_offset) {
+            module.memberOffsets[{words[1], words[2]}] = words[4];
+          }
+          break;
+        case spv_op_constant:
+        case spv_op_spec_constant:
+          module.constants[words[2]] = words[3];
+          break;
+        case spv_op_constant_composite:
+        case spv_op_spec_constant_composite:
+          module.composites[words[2]] = std::vector<uint32_t>(words + 3, words + wordCount);
+          break;
+        case spv_op_variable:
+          module.variables[words[2]] = {words[1], words[3]};
+          break;
+        case spv_op_function:
+          currentFunction = words[2];
+          break;
+        default:
+          if (op >= spv_op_type_bool && op <= spv_op_type_pointer) {
+            module.types[words[1]] = {op, std::vector<uint32_t>(words + 2, words + wordCount)};
+          }
+          break;
+      }
+    }
+
+    // A WorkgroupSize builtin overrides the LocalSize of every entry point
+    uint32_t workgroupSizeId = 0;
+    std::array<uint32_t, 3> workgroupSizeComponents = {};
+    for (const auto &[id, components] : module.composites) {
+      uint32_t builtin;
+      if (decorated(module, id, spv_decoration_builtin, &builtin) && builtin == spv_builtin_workgroup_size && components.size() == 3) {
+        workgroupSizeId = id;
+        workgroupSizeComponents = {components[0], components[1], components[2]};
+      }
+    }
+
+    for (uint32_t e = 0; e < interfaces.size(); e++) {
+      ShaderInterface &entry = interfaces[e];
+
+      // Global variables the entry point can reach through its call graph, plus its declared interface
+      std::set<uint32_t> used(entryInterfaceIds[e].begin(), entryInterfaceIds[e].end());
+      std::vector<uint32_t> pending = {entryFunctions[e]};
+      std::set<uint32_t> visited;
+      while (!pending.empty()) {
+        uint32_t function = pending.back();
+        pending.pop_back();
+        if (!visited.insert(function).second) {
+          continue;
+        }
+        for (uint32_t id : module.functionRefs[function]) {
+          if (module.functionRefs.count(id) > 0) {
+            pending.push_back(id);
+          } else if (module.variables.count(id) > 0) {
+            used.insert(id);
+          }
+        }
+      }
+
+      std::array<uint32_t, 3> sizeIds = {};
+      bool hasSizeIds = false;
+      if (workgroupSizeId != 0) {
+        sizeIds = workgroupSizeComponents;
+        hasSizeIds = true;
+      } else if (localSizeIds.count(entryFunctions[e]) > 0) {
+        sizeIds = localSizeIds[entryFunctions[e]];
+        hasSizeIds = true;
+      }
+      if (hasSizeIds) {
+        for (int d = 0; d < 3; d++) {
+          entry.localSize[d] = module.constants[sizeIds[d]];
+          decorated(module, sizeIds[d], spv_decoration_spec_id, &entry.localSizeSpecIds[d]);
+        }
+      }
+
+      for (uint32_t id : used) {
+        auto variable = module.variables.find(id);
+        if (variable == module.variables.end()) {
+          continue;
+        }
+        auto [pointerType, storage] = variable->second;
+        auto pointer = module.types.find(pointerType);
+        if (pointer == module.types.end() || pointer->second.first != spv_op_type_pointer || pointer->second.second.size() < 2) {
+          throw std::runtime_error("variable " + std::to_string(id) + " doesn't have a SPIR-V pointer type");
+        }
+        uint32_t typeId = pointer->second.second[1];
+
+        if (storage == spv_storage_push_constant) {
+          entry.pushConstantBytes = std::max<uint32_t>(entry.pushConstantBytes, spirvTypeSize(module, typeId));
+        } else if (storage == spv_storage_workgroup) {
+          ReflectedWorkgroupVariable workgroupVariable { uint32_t(-1), 0, spirvTypeSize(module, typeId) };
+          auto type = module.types.find(typeId);
+          if (type != module.types.end() && type->second.first == spv_op_type_array && type->second.second.size() >= 2 &&
+              decorated(module, type->second.second[1], spv_decoration_spec_id, &workgroupVariable.specId)) {
+            workgroupVariable.elementBytes = spirvTypeSize(module, type->second.second[0]);
+          }
+          entry.workgroupVariables.push_back(workgroupVariable);
+        } else if (storage == spv_storage_storage_buffer || storage == spv_storage_uniform || storage == spv_storage_uniform_constant) {
+          ReflectedBinding binding { 0, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 };
+          if (!decorated(module, id, spv_decoration_binding, &binding.binding)) {
+            continue;
+          }
+          decorated(module, id, spv_decoration_descriptor_set, &binding.set);
+          // Arrays of descriptors take one binding
+          auto type = module.types.find(typeId);
+          if (type != module.types.end() && type->second.first == spv_op_type_array && type->second.second.size() >= 2) {
+            binding.count = module.constants[type->second.second[1]];
+            typeId = type->second.second[0];
+          } else if (type != module.types.end() && type->second.first == spv_op_type_runtime_array && !type->second.second.empty()) {
+            binding.count = 0;
+            typeId = type->second.second[0];
+          }
+          binding.type = spirvDescriptorType(module, storage, typeId, binding);
+          entry.bindings.push_back(binding);
+        }
+      }
+      std::sort(entry.bindings.begin(), entry.bindings.end(), [](const ReflectedBinding &a, const ReflectedBinding &b) {
+        return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+      });
+    }
+    return interfaces;
+  }
+
+  VkDescriptorType descriptorType(const BufferView &view) {
+    return view.dynamic ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+
+  // This function brings descriptorSet, views, and bufferInfo to create writeDescriptorSets,
+  // which describes a descriptor set write operation
+  void writeSets(VkDescriptorSet &descriptorSet,
+      const std::vector<easyvk::BufferView> &views,
+      std::vector<VkWriteDescriptorSet> &writeDescriptorSets,
+      std::vector<VkDescriptorBufferInfo> &bufferInfos) {
+
+    // Define descriptor buffer info. Dynamic views are written at offset 0 and moved by their dynamic offset.
+    for (uint32_t i = 0; i < views.size(); i++) {
+      bufferInfos.push_back(VkDescriptorBufferInfo {
+        views[i].buffer,
+        views[i].dynamic ? 0 : views[i].offset,
+        views[i].range
+      });
+    }
+
+    // wow this bug sucked: https://medium.com/@arpytoth/the-dangerous-pointer-to-vector-a139cc42a192
+    for (uint32_t i = 0; i < views.size(); i++) {
+      writeDescriptorSets.push_back(VkWriteDescriptorSet {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        nullptr,
+        descriptorSet,
+        i,
+        0,
+        1,
+        descriptorType(views[i]),
+        nullptr,
+        &bufferInfos[i],
+        nullptr
+      });
+    }
+  }
+
+  std::map<uint32_t, uint32_t> Program::specializationConstants() {
+    // The workgroup size goes to the specialization constants the shader reads it from
+    std::map<uint32_t, uint32_t> constants;
+    for (int d = 0; d < 3; d++) {
+      if (reflected.localSizeSpecIds[d] != uint32_t(-1)) {
+        constants[reflected.localSizeSpecIds[d]] = workgroupSize[d];
+      } else if (workgroupSize[d] != reflected.localSize[d]) {
+        throw std::runtime_error("entry point " + entryPoint + " fixes its local size in dimension " + std::to_string(d) + " at " +
+          std::to_string(reflected.localSize[d]) + ", not " + std::to_string(workgroupSize[d]));
+      }
+    }
+
+    // key is index, value is length. The length of workgroup memory index i is specialization constant 3 + i.
+    uint64_t workgroupBytes = 0;
+    for (const auto &variable : reflected.workgroupVariables) {
+      auto length = workgroupMemoryLengths.end();
+      if (variable.specId >= 3) {
+        length = workgroupMemoryLengths.find(variable.specId - 3);
+      }
+      workgroupBytes += length == workgroupMemoryLengths.end() ? variable.sizeBytes : uint64_t(length->second) * variable.elementBytes;
+    }
+    for (const auto &[key, value] : workgroupMemoryLengths) {
+      bool sized = std::any_of(reflected.workgroupVariables.begin(), reflected.workgroupVariables.end(),
+        [&](const ReflectedWorkgroupVariable &variable) { return variable.specId == 3 + key; });
+      if (!sized) {
+        throw std::runtime_error("entry point " + entryPoint + " has no workgroup memory sized by specialization constant " + std::to_string(3 + key));
+      }
+      constants[3 + key] = value;
+    }
+    if (workgroupBytes > device.properties.limits.maxComputeSharedMemorySize) {
+      throw std::runtime_error(std::to_string(workgroupBytes) + " bytes of workgroup memory exceed the device limit of " +
+        std::to_string(device.properties.limits.maxComputeSharedMemorySize));
+    }
+    return constants;
+  }
+
+  void Program::selectPipeline() {
+    auto constants = specializationConstants();
+    auto variant = pipelineVariants.find(constants);
+    if (variant == pipelineVariants.end()) {
+      std::vector<VkSpecializationMapEntry> specMap;
+      std::vector<uint32_t> specMapContent;
+      for (const auto &[id, value] : constants) {
+        specMap.push_back(VkSpecializationMapEntry{id, uint32_t(specMapContent.size() * sizeof(uint32_t)), sizeof(uint32_t)});
+        specMapContent.push_back(value);
+      }
+      VkSpecializationInfo specInfo{(uint32_t)specMap.size(), specMap.data(), specMapContent.size() * sizeof(uint32_t), specMapContent.data()};
+
+      // Define shader stage create info
+      VkPipelineShaderStageCreateInfo stageCI {
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         nullptr,
-        &fence));
+        pipelineFlags,
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        shaderModule,
+        entryPoint.c_str(),
+        &specInfo
+      };
+
+      // Define compute pipeline create info
+      VkComputePipelineCreateInfo pipelineCI {
+        VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        nullptr,
+        {},
+        stageCI,
+        pipelineLayout
+      };
+
+      // Create compute pipelines
+      VkPipeline variantPipeline;
+      vkCheck(vkCreateComputePipelines(device.device, device.pipelineCache, 1, &pipelineCI, nullptr, &variantPipeline));
+      variant = pipelineVariants.emplace(constants, variantPipeline).first;
+    }
+    if (pipeline != variant->second) {
+      pipeline = variant->second;
+      invalidateRecordings();
+    }
+  }
+
+  void Program::initialize(const char *entry_point, VkPipelineShaderStageCreateFlags _pipelineFlags) {
+    auto found = std::find_if(entryPoints.begin(), entryPoints.end(), [&](const ShaderInterface &entry) {
+      return entry.entryPoint == entry_point;
+    });
+    if (found == entryPoints.end()) {
+      throw std::runtime_error(std::string("entry point ") + entry_point + " not found in shader");
+    }
+    reflected = *found;
+    adoptBuffers();
+
+    // Every descriptor the shader uses must be a storage buffer in set 0 that the program has a binding for
+    for (const auto &binding : reflected.bindings) {
+      std::string where = "binding " + std::to_string(binding.binding) + " of entry point " + entry_point;
+      if (binding.set != 0) {
+        throw std::runtime_error(where + " is in descriptor set " + std::to_string(binding.set) + ", Programs only bind set 0");
+      }
+      if (binding.type != VK_DESCRIPTOR_TYPE_STORAGE_BUFFER || binding.count != 1) {
+        throw std::runtime_error(where + " is not a single storage buffer");
+      }
+      if (binding.binding >= bindings.size()) {
+        throw std::runtime_error(where + " has no buffer, only " + std::to_string(bindings.size()) + " were given");
+      }
+    }
+    // Fixed dimensions of the local size are taken from the shader unless set explicitly
+    for (int d = 0; d < 3; d++) {
+      if (!workgroupSizeSet && reflected.localSizeSpecIds[d] == uint32_t(-1)) {
+        workgroupSize[d] = reflected.localSize[d];
+      }
+    }
+
+    uint32_t dynamicCount = 0;
+    for (const auto &view : bindings) {
+      dynamicCount += view.dynamic;
+    }
+    if (dynamicCount > device.properties.limits.maxDescriptorSetStorageBuffersDynamic) {
+      throw std::runtime_error(std::to_string(dynamicCount) + " dynamic buffer views exceed the device limit of " +
+        std::to_string(device.properties.limits.maxDescriptorSetStorageBuffersDynamic));
+    }
+    // Push descriptor layouts can't contain dynamic descriptors
+    usePushDescriptors = device.supportsPushDescriptors && dynamicCount == 0 && bindings.size() <= device.maxPushDescriptors;
+    // Layouts are shared with every other program on the device that has the same interface
+    LayoutCache &cache = device.layoutCache();
+    // Programs that only take buffer addresses have no descriptor set at all
+    bool hasDescriptors = !bindings.empty();
+    if (hasDescriptors) {
+      // Built from the program's buffers, not the reflected bindings, so bind() can fill any slot the program
+      // was created with. The checks above make the shader's bindings a subset with matching types.
+      std::vector<VkDescriptorType> types;
+      for (const auto &view : bindings) {
+        types.push_back(descriptorType(view));
+      }
+      descriptorSetLayout = cache.descriptorSetLayout(types, usePushDescriptors);
+    } else {
+      descriptorSetLayout = VK_NULL_HANDLE;
+      usePushDescriptors = false;
+    }
+
+    // The push constant range is exactly the shader's block, and left out when it has none
+    pushConstantRangeBytes = (reflected.pushConstantBytes + 3) & ~3u;
+    pipelineLayout = cache.pipelineLayout(descriptorSetLayout, pushConstantRangeBytes);
+
+    // Allocate the ring of descriptor sets from the device's shared pools
+    if (hasDescriptors && !usePushDescriptors) {
+      descriptorSets.resize(descriptor_set_ring_size);
+      descriptorPool = cache.allocate(descriptorSetLayout, descriptor_set_ring_size, descriptorSets.data());
+      descriptorSet = descriptorSets[0];
+    }
+
+    writeBindings();
+
+    entryPoint = entry_point;
+    pipelineFlags = _pipelineFlags;
+    initialized = true;
+    selectPipeline();
+
+    // Create fence.
+    VkFenceCreateInfo fenceCreateInfo {
+      VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      nullptr,
+      0
+    };
+    vkCheck(vkCreateFence(device.device, &fenceCreateInfo, nullptr, &fence));
 
     // Define command pool info
     VkCommandPoolCreateInfo commandPoolCreateInfo {
@@ -775,234 +2596,994 @@ namespace easyvk {
       device.computeFamilyId
     };
 
-    // Create command pool
-    vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+    // Create command pool
+    vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+
+    // Define command buffer info
+    VkCommandBufferAllocateInfo commandBufferAI {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        nullptr,
+        commandPool,
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        3
+    };
+
+    // Allocate command buffers, one each for run(), runWithDispatchTiming() and runIndirect()
+    VkCommandBuffer commandBuffers[3];
+    vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAI, commandBuffers));
+    commandBuffer = commandBuffers[0];
+    timedCommandBuffer = commandBuffers[1];
+    indirectCommandBuffer = commandBuffers[2];
+    invalidateRecordings();
+
+    // Create timestamp query pool
+    // TODO: Device support limits need to be queried.
+    VkQueryPoolCreateInfo queryPoolCreateInfo {
+      VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      nullptr,
+      0,
+      VK_QUERY_TYPE_TIMESTAMP,
+      2
+    };
+    vkCheck(vkCreateQueryPool(device.device, &queryPoolCreateInfo, nullptr, &timestampQueryPool));
+  }
+
+  const ShaderInterface &Program::shaderInterface() {
+    return reflected;
+  }
+
+  std::vector<ShaderStatistics> Program::getShaderStats() {
+    std::vector<ShaderStatistics> stats;
+    if (device.supportsAMDShaderStats) {
+      VkShaderStatisticsInfoAMD statInfo = {};
+      size_t infoSize = sizeof(statInfo);
+      PFN_vkGetShaderInfoAMD pfnGetShaderInfoAMD = (PFN_vkGetShaderInfoAMD)vkGetDeviceProcAddr(
+        device.device, "vkGetShaderInfoAMD");
+      vkCheck(pfnGetShaderInfoAMD(
+        device.device,
+        pipeline,
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        VK_SHADER_INFO_TYPE_STATISTICS_AMD,
+        &infoSize,
+        &statInfo));
+      stats.push_back(ShaderStatistics{ "Physical Vgprs", "Physical vector general purpose registers", 2, statInfo.numPhysicalVgprs });
+      stats.push_back(ShaderStatistics{ "Physical Sgprs", "Physical scalar general purpose registers", 2, statInfo.numPhysicalSgprs });
+      stats.push_back(ShaderStatistics{ "Compiler Vgprs", "Compiler vector general purpose registers", 2, statInfo.numAvailableVgprs });
+      stats.push_back(ShaderStatistics{ "Compiler Sgprs", "Compiler scalar general purpose registers", 2, statInfo.numAvailableSgprs });
+    }
+
+    // we assume there is only one executable (e.g. shader) associated with this pipeline, or at least, the first one is the one we want stats for
+    VkPipelineExecutableInfoKHR pExecutableInfo = { VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_INFO_KHR, nullptr, pipeline, 0 };
+    PFN_vkGetPipelineExecutableStatisticsKHR pfnGetPipelineExecutableStatistics = (PFN_vkGetPipelineExecutableStatisticsKHR)vkGetDeviceProcAddr(
+      device.device, "vkGetPipelineExecutableStatisticsKHR");
+    uint32_t executableCount = 0;
+    // get the count of statistics
+    pfnGetPipelineExecutableStatistics(device.device, &pExecutableInfo, &executableCount, nullptr);
+    std::vector<VkPipelineExecutableStatisticKHR> statistics(executableCount, { VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_STATISTIC_KHR });
+    // get the actual statistics
+    pfnGetPipelineExecutableStatistics(device.device, &pExecutableInfo, &executableCount, statistics.data());
+    // Output statistics
+    for (const auto& stat : statistics) {
+      switch (stat.format) {
+      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_BOOL32_KHR:
+        stats.push_back(ShaderStatistics{ stat.name, stat.description, 0, stat.value.b32 });
+        break;
+      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_INT64_KHR:
+        stats.push_back(ShaderStatistics{ stat.name, stat.description, 1, (uint64_t) stat.value.i64 });
+        break;
+      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_UINT64_KHR:
+        stats.push_back(ShaderStatistics{ stat.name, stat.description, 2, stat.value.u64 });
+        break;
+      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_FLOAT64_KHR:
+        stats.push_back(ShaderStatistics{ stat.name, stat.description, 3, (uint64_t) stat.value.f64 });
+        break;
+      default:
+        break;
+      }
+    }
+
+    // The query holds the results of the most recent run until the next one resets it
+    if (statisticsQueryPool != VK_NULL_HANDLE && statisticsAvailable) {
+      uint64_t invocations = 0;
+      vkCheck(vkGetQueryPoolResults(
+          device.device,
+          statisticsQueryPool,
+          0,
+          1,
+          sizeof(uint64_t),
+          &invocations,
+          sizeof(uint64_t),
+          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+      stats.push_back(ShaderStatistics{ "Compute Shader Invocations", "Compute shader invocations executed by the most recent run", 2, invocations });
+    }
+    return stats;
+  }
+
+  void Program::enablePipelineStatistics(bool enable) {
+    if (enable && !device.supportsPipelineStatistics) {
+      throw std::runtime_error("device doesn't support the pipelineStatisticsQuery feature");
+    }
+    if (enable == (statisticsQueryPool != VK_NULL_HANDLE)) {
+      return;
+    }
+    if (enable) {
+      VkQueryPoolCreateInfo queryPoolCreateInfo {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        VK_QUERY_TYPE_PIPELINE_STATISTICS,
+        1,
+        VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT
+      };
+      vkCheck(vkCreateQueryPool(device.device, &queryPoolCreateInfo, nullptr, &statisticsQueryPool));
+    } else {
+      vkDestroyQueryPool(device.device, statisticsQueryPool, nullptr);
+      statisticsQueryPool = VK_NULL_HANDLE;
+    }
+    statisticsAvailable = false;
+    invalidateRecordings();
+  }
+
+  void Program::recordRun(VkCommandBuffer commandBuffer, bool timed, VkBuffer indirectBuffer, uint64_t indirectOffset) {
+    // Start recording command buffer. Not one-time-submit, it is replayed until the program changes.
+    VkCommandBufferBeginInfo beginInfo {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      nullptr,
+      0,
+      nullptr
+    };
+    vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+    // Reset query pool.
+    if (timed) {
+      vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, 2);
+    }
+    if (statisticsQueryPool != VK_NULL_HANDLE) {
+      vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, 0, 1);
+    }
+
+    memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+    // Indirect arguments may have been written by an earlier dispatch or transfer
+    if (indirectBuffer != VK_NULL_HANDLE) {
+      memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+    }
+
+    // Write first timestamp.
+    if (timed) {
+      vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 0);
+    }
+
+    // Bind, push constants and dispatch compute work items
+    if (statisticsQueryPool != VK_NULL_HANDLE) {
+      vkCmdBeginQuery(commandBuffer, statisticsQueryPool, 0, 0);
+    }
+    _recordDispatch(commandBuffer, indirectBuffer, indirectOffset);
+    if (statisticsQueryPool != VK_NULL_HANDLE) {
+      vkCmdEndQuery(commandBuffer, statisticsQueryPool, 0);
+    }
+
+    memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+    // Write second timestamp.
+    if (timed) {
+      vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 1);
+    }
+
+    // End recording command buffer
+    vkCheck(vkEndCommandBuffer(commandBuffer));
+  }
+
+  void Program::submitAndWait(VkCommandBuffer commandBuffer) {
+    // Submit command buffer to queue, signals fence on completion. Going through the device makes
+    // completed work from the transfer queue visible to the dispatch.
+    device.submit(commandBuffer, {}, fence);
+    // Wait on fence.
+    vkCheck(vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX));
+    // Reset fence signal.
+    vkCheck(vkResetFences(device.device, 1, &fence));
+    statisticsAvailable = statisticsQueryPool != VK_NULL_HANDLE;
+  }
+
+  void Program::run() {
+    if (!recorded) {
+      recordRun(commandBuffer, false);
+      recorded = true;
+    }
+    submitAndWait(commandBuffer);
+  }
+
+  void Program::runIndirect(Buffer &args, uint64_t offset) {
+    if (offset % 4 != 0 || offset + sizeof(VkDispatchIndirectCommand) > args.size) {
+      throw std::runtime_error("indirect dispatch arguments at offset " + std::to_string(offset) +
+        " must be 4 byte aligned and fit in a buffer of " + std::to_string(args.size) + " bytes");
+    }
+    if (!indirectRecorded || indirectBuffer != args.buffer || indirectOffset != offset) {
+      indirectBuffer = args.buffer;
+      indirectOffset = offset;
+      recordRun(indirectCommandBuffer, false, indirectBuffer, indirectOffset);
+      indirectRecorded = true;
+    }
+    submitAndWait(indirectCommandBuffer);
+  }
+
+  DispatchTimeline Program::timedRun(bool onHostClock) {
+    if (!timedRecorded) {
+      recordRun(timedCommandBuffer, true);
+      timedRecorded = true;
+    }
+
+    DispatchTimeline timeline {};
+    timeline.submitNs = hostClockNs();
+    // Submit command buffer to queue, signals fence on completion. Going through the device makes
+    // completed work from the transfer queue visible to the dispatch.
+    device.submit(timedCommandBuffer, {}, fence);
+    timeline.submittedNs = hostClockNs();
+    // Wait on fence.
+    vkCheck(vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX));
+    timeline.completeNs = hostClockNs();
+    // Reset fence signal.
+    vkCheck(vkResetFences(device.device, 1, &fence));
+    statisticsAvailable = statisticsQueryPool != VK_NULL_HANDLE;
+
+    // Get timestamp query results.
+    uint64_t queryResults[2] = {0, 0};
+    vkCheck(vkGetQueryPoolResults(
+        device.device,
+        timestampQueryPool,
+        0,
+        2,
+        sizeof(uint64_t) * 2,
+        queryResults,
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    timeline.durationNs = device.ticksToNs(queryResults[0], queryResults[1]);
+    if (onHostClock) {
+      timeline.startNs = device.deviceToHostNs(queryResults[0]);
+      timeline.endNs = timeline.startNs + timeline.durationNs;
+    }
+    return timeline;
+  }
+
+  uint64_t Program::runWithDispatchTiming() {
+    return timedRun(false).durationNs;
+  }
+
+  DispatchTimeline Program::runWithTimeline() {
+    return timedRun(true);
+  }
+
+  void Program::_recordDispatch(VkCommandBuffer commandBuffer, VkBuffer indirectBuffer, uint64_t indirectOffset) {
+    // Bind pipeline and descriptor sets
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    // Programs that take buffer addresses in their push constants have no set to bind
+    if (usePushDescriptors) {
+      device.cmdPushDescriptorSet(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0,
+                                  writeDescriptorSets.size(), writeDescriptorSets.data());
+    } else if (descriptorSet != VK_NULL_HANDLE) {
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              pipelineLayout, 0, 1, &descriptorSet, dynamicOffsets.size(), dynamicOffsets.data());
+    }
+
+    // Bind push constants, the whole block the shader declares
+    if (pushConstantRangeBytes > 0) {
+      vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantRangeBytes, pushConstants.data());
+    }
+
+    // Dispatch compute work items
+    if (indirectBuffer != VK_NULL_HANDLE) {
+      vkCmdDispatchIndirect(commandBuffer, indirectBuffer, indirectOffset);
+    } else {
+      vkCmdDispatch(commandBuffer, numWorkgroups[0], numWorkgroups[1], numWorkgroups[2]);
+    }
+  }
+
+  void Program::invalidateRecordings() {
+    recorded = false;
+    timedRecorded = false;
+    indirectRecorded = false;
+    generation++;
+  }
+
+  void Program::setWorkgroups(uint32_t x, uint32_t y, uint32_t z) {
+    const auto &limits = device.properties.limits;
+    std::array<uint32_t, 3> counts = {x, y, z};
+    for (int i = 0; i < 3; i++) {
+      if (counts[i] > limits.maxComputeWorkGroupCount[i]) {
+        throw std::runtime_error("workgroup count " + std::to_string(counts[i]) + " in dimension " + std::to_string(i) +
+          " exceeds the device limit of " + std::to_string(limits.maxComputeWorkGroupCount[i]));
+      }
+    }
+    if (numWorkgroups != counts) {
+      invalidateRecordings();
+    }
+    numWorkgroups = counts;
+  }
+
+  void Program::setPushConstants(const void *data, uint32_t size, uint32_t offset) {
+    if (uint64_t(offset) + size > pushConstants.size()) {
+      throw std::runtime_error("push constants of " + std::to_string(offset + size) + " bytes exceed the device limit of " +
+        std::to_string(pushConstants.size()) + " bytes");
+    }
+    if (uint64_t(offset) + size > pushConstantRangeBytes) {
+      throw std::runtime_error("push constants of " + std::to_string(offset + size) + " bytes exceed the push constant block of entry point " +
+        entryPoint + " (" + std::to_string(pushConstantRangeBytes) + " bytes)");
+    }
+    if (memcmp(pushConstants.data() + offset, data, size) == 0) {
+      return;
+    }
+    memcpy(pushConstants.data() + offset, data, size);
+    invalidateRecordings();
+  }
+
+  void Program::setBufferAddress(uint32_t offset, Buffer &buffer) {
+    setPushConstants(buffer.deviceAddress(), offset);
+    addressedBuffers[offset] = buffer.buffer;
+  }
+
+  void Program::setWorkgroupSize(uint32_t x, uint32_t y, uint32_t z) {
+    const auto &limits = device.properties.limits;
+    std::array<uint32_t, 3> size = {x, y, z};
+    for (int i = 0; i < 3; i++) {
+      if (size[i] == 0 || size[i] > limits.maxComputeWorkGroupSize[i]) {
+        throw std::runtime_error("workgroup size " + std::to_string(size[i]) + " in dimension " + std::to_string(i) +
+          " must be between 1 and " + std::to_string(limits.maxComputeWorkGroupSize[i]));
+      }
+    }
+    if (uint64_t(x) * y * z > limits.maxComputeWorkGroupInvocations) {
+      throw std::runtime_error("workgroup size of " + std::to_string(uint64_t(x) * y * z) +
+        " invocations exceeds the device limit of " + std::to_string(limits.maxComputeWorkGroupInvocations));
+    }
+    workgroupSize = size;
+    workgroupSizeSet = true;
+    if (initialized) {
+      selectPipeline();
+    }
+  }
+
+  void Program::setWorkgroupMemoryLength(uint32_t length, uint32_t index) {
+    workgroupMemoryLengths[index] = length;
+    if (initialized) {
+      selectPipeline();
+    }
+  }
+
+  void Program::writeBindings() {
+    dynamicOffsets.clear();
+    for (const auto &view : bindings) {
+      if (view.dynamic) {
+        dynamicOffsets.push_back(view.offset);
+      }
+    }
+    writeDescriptorSets.clear();
+    bufferInfos.clear();
+    writeSets(descriptorSet, bindings, writeDescriptorSets, bufferInfos);
 
-    // Define command buffer info
-    VkCommandBufferAllocateInfo commandBufferAI {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        nullptr,
-        commandPool,
-        VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        1
-    };
+    // Pushed descriptors are recorded into the command buffer along with the dispatch instead
+    if (!usePushDescriptors && !writeDescriptorSets.empty()) {
+      vkUpdateDescriptorSets(device.device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, {});
+    }
+  }
 
-    // Allocate command buffers
-    vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAI, &commandBuffer));
+  void Program::rebind() {
+    if (!usePushDescriptors && !descriptorSets.empty()) {
+      // The current set may still be referenced by submitted work, so write the next one in the ring
+      descriptorSetIndex = (descriptorSetIndex + 1) % descriptorSets.size();
+      descriptorSet = descriptorSets[descriptorSetIndex];
+    }
+    writeBindings();
+    invalidateRecordings();
+  }
 
-    // Create timestamp query pool
-    // TODO: Device support limits need to be queried.
-    vkCheck(vkCreateQueryPool(
-        device.device,
-        new VkQueryPoolCreateInfo {
-          VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-          VK_NULL_HANDLE,
-          0,
-          VK_QUERY_TYPE_TIMESTAMP,
-          2
-        },
-        VK_NULL_HANDLE,
-        &timestampQueryPool));
+  void Program::adoptBuffers() {
+    if (buffers != nullptr) {
+      bindings.assign(buffers->begin(), buffers->end());
+      buffers = nullptr;
+    }
   }
 
-  std::vector<ShaderStatistics> Program::getShaderStats() {
-    std::vector<ShaderStatistics> stats;
-    if (device.supportsAMDShaderStats) {
-      VkShaderStatisticsInfoAMD statInfo = {};
-      size_t infoSize = sizeof(statInfo);
-      PFN_vkGetShaderInfoAMD pfnGetShaderInfoAMD = (PFN_vkGetShaderInfoAMD)vkGetDeviceProcAddr(
-        device.device, "vkGetShaderInfoAMD");
-      vkCheck(pfnGetShaderInfoAMD(
-        device.device,
-        pipeline,
-        VK_SHADER_STAGE_COMPUTE_BIT,
-        VK_SHADER_INFO_TYPE_STATISTICS_AMD,
-        &infoSize,
-        &statInfo));
-      stats.push_back(ShaderStatistics{ "Physical Vgprs", "Physical vector general purpose registers", 2, statInfo.numPhysicalVgprs });
-      stats.push_back(ShaderStatistics{ "Physical Sgprs", "Physical scalar general purpose registers", 2, statInfo.numPhysicalSgprs });
-      stats.push_back(ShaderStatistics{ "Compiler Vgprs", "Compiler vector general purpose registers", 2, statInfo.numAvailableVgprs });
-      stats.push_back(ShaderStatistics{ "Compiler Sgprs", "Compiler scalar general purpose registers", 2, statInfo.numAvailableSgprs });
+  void Program::bind(uint32_t index, const BufferView &view) {
+    adoptBuffers();
+    if (index >= bindings.size()) {
+      throw std::runtime_error("binding " + std::to_string(index) + " is out of range for a program with " +
+        std::to_string(bindings.size()) + " bindings");
     }
+    if (initialized && view.dynamic != bindings[index].dynamic) {
+      throw std::runtime_error("binding " + std::to_string(index) + " can't switch between dynamic and static after initialize");
+    }
+    bindings[index] = view;
+    if (initialized) {
+      rebind();
+    }
+  }
 
-    // we assume there is only one executable (e.g. shader) associated with this pipeline, or at least, the first one is the one we want stats for
-    VkPipelineExecutableInfoKHR pExecutableInfo = { VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_INFO_KHR, nullptr, pipeline, 0 };
-    PFN_vkGetPipelineExecutableStatisticsKHR pfnGetPipelineExecutableStatistics = (PFN_vkGetPipelineExecutableStatisticsKHR)vkGetDeviceProcAddr(
-      device.device, "vkGetPipelineExecutableStatisticsKHR");
-    uint32_t executableCount = 0;
-    // get the count of statistics
-    pfnGetPipelineExecutableStatistics(device.device, &pExecutableInfo, &executableCount, nullptr);
-    std::vector<VkPipelineExecutableStatisticKHR> statistics(executableCount, { VK_STRUCTURE_TYPE_PIPELINE_EXECUTABLE_STATISTIC_KHR });
-    // get the actual statistics
-    pfnGetPipelineExecutableStatistics(device.device, &pExecutableInfo, &executableCount, statistics.data());
-    // Output statistics
-    for (const auto& stat : statistics) {
-      switch (stat.format) {
-      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_BOOL32_KHR:
-        stats.push_back(ShaderStatistics{ stat.name, stat.description, 0, stat.value.b32 });
-        break;
-      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_INT64_KHR:
-        stats.push_back(ShaderStatistics{ stat.name, stat.description, 1, (uint64_t) stat.value.i64 });
-        break;
-      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_UINT64_KHR:
-        stats.push_back(ShaderStatistics{ stat.name, stat.description, 2, stat.value.u64 });
-        break;
-      case VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_FLOAT64_KHR:
-        stats.push_back(ShaderStatistics{ stat.name, stat.description, 3, (uint64_t) stat.value.f64 });
-        break;
-      default:
-        break;
+  void Program::bindAll(const std::vector<BufferView> &views) {
+    buffers = nullptr;
+    if (initialized) {
+      if (views.size() != bindings.size()) {
+        throw std::runtime_error("program was initialized with " + std::to_string(bindings.size()) + " bindings but " +
+          std::to_string(views.size()) + " were given");
+      }
+      for (uint32_t i = 0; i < views.size(); i++) {
+        if (views[i].dynamic != bindings[i].dynamic) {
+          throw std::runtime_error("binding " + std::to_string(i) + " can't switch between dynamic and static after initialize");
+        }
       }
     }
-    return stats;
+    bindings = views;
+    if (initialized) {
+      rebind();
+    }
   }
 
-  void Program::run() {
-    // Start recording command buffer
-    vkCheck(vkBeginCommandBuffer(commandBuffer, new VkCommandBufferBeginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO}));
+  void Program::bindAll(std::vector<Buffer> &buffers) {
+    bindAll(std::vector<BufferView>(buffers.begin(), buffers.end()));
+  }
 
-    // Bind pipeline and descriptor sets
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                            pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+  void Program::setBindingOffset(uint32_t index, uint64_t offset) {
+    if (index >= bindings.size() || !bindings[index].dynamic) {
+      throw std::runtime_error("binding " + std::to_string(index) + " is not a dynamic buffer view");
+    }
+    auto &view = bindings[index];
+    uint64_t alignment = device.properties.limits.minStorageBufferOffsetAlignment;
+    if (alignment != 0 && offset % alignment != 0) {
+      throw std::runtime_error("binding offset " + std::to_string(offset) + " is not a multiple of minStorageBufferOffsetAlignment (" +
+        std::to_string(alignment) + ")");
+    }
+    if (offset > view.bufferSize || view.range > view.bufferSize - offset) {
+      throw std::runtime_error("binding of " + std::to_string(view.range) + " bytes at offset " + std::to_string(offset) +
+        " runs past the end of a " + std::to_string(view.bufferSize) + " byte buffer");
+    }
+    if (view.offset == offset) {
+      return;
+    }
+    view.offset = offset;
+    if (initialized) {
+      // Dynamic offsets are stored in binding order among the dynamic bindings
+      uint32_t dynamicIndex = 0;
+      for (uint32_t i = 0; i < index; i++) {
+        dynamicIndex += bindings[i].dynamic;
+      }
+      dynamicOffsets[dynamicIndex] = offset;
+      invalidateRecordings();
+    }
+  }
 
-    // Bind push constants
-    uint32_t pValues[3] = {0, 0, 0};
-    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, &pValues);
+  Program::Program(Device &_device, std::vector<uint32_t> spvCode, std::vector<Buffer> &_buffers) : bindings(_buffers.begin(), _buffers.end()),
+                                                                                                    buffers(&_buffers),
+                                                                                                    shaderModule(initShaderModule(_device, spvCode)),
+                                                                                                    shaderHash(hashSpirv(spvCode)),
+                                                                                                    entryPoints(reflectSpirv(spvCode)),
+                                                                                                    device(_device),
+                                                                                                    pushConstants(_device.properties.limits.maxPushConstantsSize, 0),
+                                                                                                    pushConstantRangeBytes(_device.properties.limits.maxPushConstantsSize) {}
 
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-                         1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+  Program::Program(Device &_device, const char *filepath, std::vector<Buffer> &_buffers) : Program(_device, read_spirv(filepath), _buffers) {}
 
-    // Dispatch compute work items
-    vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+  Program::Program(Device &_device, std::vector<uint32_t> spvCode, const std::vector<BufferView> &views) : bindings(views),
+                                                                                                           shaderModule(initShaderModule(_device, spvCode)),
+                                                                                                           shaderHash(hashSpirv(spvCode)),
+                                                                                                           entryPoints(reflectSpirv(spvCode)),
+                                                                                                           device(_device),
+                                                                                                           pushConstants(_device.properties.limits.maxPushConstantsSize, 0),
+                                                                                                           pushConstantRangeBytes(_device.properties.limits.maxPushConstantsSize) {}
 
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-                         1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+  Program::Program(Device &_device, const char *filepath, const std::vector<BufferView> &views) : Program(_device, read_spirv(filepath), views) {}
 
-    // End recording command buffer
-    vkCheck(vkEndCommandBuffer(commandBuffer));
-    
-    // Define submit info
-    VkSubmitInfo submitInfo {
-      VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      nullptr,
-      0,
+  Program::Program(Device &_device, std::vector<uint32_t> spvCode) : Program(_device, spvCode, std::vector<BufferView>{}) {}
+
+  Program::Program(Device &_device, const char *filepath) : Program(_device, read_spirv(filepath), std::vector<BufferView>{}) {}
+
+  void Program::teardown() {
+    vkDestroyShaderModule(device.device, shaderModule, nullptr);
+    // Layouts stay in the device's cache for other programs, only the descriptor sets are returned
+    if (!descriptorSets.empty()) {
+      device.layoutCache().free(descriptorPool, descriptorSets);
+    }
+    for (const auto &[constants, variant] : pipelineVariants) {
+      vkDestroyPipeline(device.device, variant, nullptr);
+    }
+    vkDestroyFence(device.device, fence, nullptr);
+    vkDestroyCommandPool(device.device, commandPool, nullptr);
+    vkDestroyQueryPool(device.device, timestampQueryPool, VK_NULL_HANDLE);
+    if (statisticsQueryPool != VK_NULL_HANDLE) {
+      vkDestroyQueryPool(device.device, statisticsQueryPool, nullptr);
+    }
+  }
+
+  // -------------------------------------------------------------------------------
+
+  CommandGraph::CommandGraph(Device &_device) : device(_device) {
+    // The graph's command buffer is reset and re-recorded whenever commands are added
+    VkCommandPoolCreateInfo commandPoolCreateInfo {
+      VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
       nullptr,
+      VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      device.computeFamilyId
+    };
+    vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+
+    VkCommandBufferAllocateInfo commandBufferAI {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
       nullptr,
-      1,
-      &commandBuffer,
-      0,
-      nullptr
+      commandPool,
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      1
     };
+    vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAI, &commandBuffer));
+  }
 
-    auto queue = device.computeQueue;
+  void CommandGraph::dispatch(Program &program) {
+    GraphCommand command {};
+    command.type = GRAPH_DISPATCH;
+    command.program = &program;
+    commands.push_back(command);
+    recorded = false;
+  }
 
-    // Submit command buffer to queue, signals fence on completion.
-    vkCheck(vkQueueSubmit(queue, 1, &submitInfo, fence));
-    // Wait on fence.
-    vkCheck(vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX));
-    // Reset fence signal.
-    vkCheck(vkResetFences(device.device, 1, &fence));
+  void CommandGraph::copy(Buffer &src, Buffer &dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset) {
+    GraphCommand command {};
+    command.type = GRAPH_COPY;
+    command.src = src.buffer;
+    command.dst = dst.buffer;
+    command.len = len;
+    command.srcOffset = srcOffset;
+    command.dstOffset = dstOffset;
+    commands.push_back(command);
+    recorded = false;
+  }
+
+  void CommandGraph::fill(Buffer &buffer, uint32_t word, uint64_t offset) {
+    GraphCommand command {};
+    command.type = GRAPH_FILL;
+    command.dst = buffer.buffer;
+    command.word = word;
+    command.dstOffset = offset;
+    commands.push_back(command);
+    recorded = false;
   }
 
-  float Program::runWithDispatchTiming() {
-    // Start recording command buffer
-    vkCheck(vkBeginCommandBuffer(commandBuffer, new VkCommandBufferBeginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO}));
+  void CommandGraph::timestamp(std::string name) {
+    GraphCommand command {};
+    command.type = GRAPH_TIMESTAMP;
+    command.query = markerNames.size();
+    markerNames.push_back(name);
+    commands.push_back(command);
+    recorded = false;
+  }
 
-    // Reset query pool.
-    vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, 2);
+  void CommandGraph::beginScope(std::string name) {
+    GraphCommand command {};
+    command.type = GRAPH_SCOPE_BEGIN;
+    command.query = scopeNames.size();
+    scopeNames.push_back(name);
+    commands.push_back(command);
+    recorded = false;
+  }
 
-    // Bind pipeline and descriptor sets
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                            pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+  void CommandGraph::endScope() {
+    GraphCommand command {};
+    command.type = GRAPH_SCOPE_END;
+    commands.push_back(command);
+    recorded = false;
+  }
 
-    // Bind push constants
-    uint32_t pValues[3] = {0, 0, 0};
-    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, &pValues);
+  void CommandGraph::record() {
+    // The command buffer can't be reset while a previous submission is still executing
+    lastSubmit.wait();
+    // Scopes of a recording that is replaced before it was submitted would never resolve
+    if (profiled) {
+      device.profiler().discard(commandBuffer);
+    }
+    profiled = !scopeNames.empty();
 
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-                         1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+    // Grow the timestamp query pool to fit every marker
+    if (timestampQueryCount < markerNames.size()) {
+      if (timestampQueryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device.device, timestampQueryPool, nullptr);
+      }
+      VkQueryPoolCreateInfo queryPoolCreateInfo {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        VK_QUERY_TYPE_TIMESTAMP,
+        (uint32_t)markerNames.size()
+      };
+      vkCheck(vkCreateQueryPool(device.device, &queryPoolCreateInfo, nullptr, &timestampQueryPool));
+      timestampQueryCount = markerNames.size();
+    }
 
-    // Write first timestamp.
-    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 0);
+    // Not one-time-submit, the graph is replayed until it changes
+    VkCommandBufferBeginInfo beginInfo {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      nullptr,
+      0,
+      nullptr
+    };
+    vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    if (!markerNames.empty()) {
+      vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, markerNames.size());
+    }
 
-    // Dispatch compute work items
-    vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+    // Order the graph after whatever was submitted to the queue before it
+    memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_WRITE_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+
+    // Buffers read and written since the last barrier, and the stages/accesses that touched them
+    std::set<VkBuffer> readSinceBarrier;
+    std::set<VkBuffer> writtenSinceBarrier;
+    VkPipelineStageFlags pendingStages = 0;
+    VkAccessFlags pendingWrites = 0;
+
+    std::vector<uint32_t> openScopes;
+    for (auto &command : commands) {
+      if (command.type == GRAPH_TIMESTAMP) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, command.query);
+        continue;
+      }
+      if (command.type == GRAPH_SCOPE_BEGIN) {
+        openScopes.push_back(device.profiler().begin(commandBuffer, scopeNames[command.query]));
+        continue;
+      }
+      if (command.type == GRAPH_SCOPE_END) {
+        if (openScopes.empty()) {
+          throw std::runtime_error("endScope without a matching beginScope");
+        }
+        device.profiler().end(commandBuffer, openScopes.back());
+        openScopes.pop_back();
+        continue;
+      }
 
-    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-                         1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+      // Programs are assumed to both read and write every buffer bound to them
+      std::vector<VkBuffer> reads;
+      std::vector<VkBuffer> writes;
+      VkPipelineStageFlags stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+      VkAccessFlags writeAccess = VK_ACCESS_TRANSFER_WRITE_BIT;
+      if (command.type == GRAPH_DISPATCH) {
+        for (auto &view : command.program->bindings) {
+          reads.push_back(view.buffer);
+          writes.push_back(view.buffer);
+        }
+        for (const auto &[offset, buffer] : command.program->addressedBuffers) {
+          reads.push_back(buffer);
+          writes.push_back(buffer);
+        }
+        stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        writeAccess = VK_ACCESS_SHADER_WRITE_BIT;
+      } else if (command.type == GRAPH_COPY) {
+        reads.push_back(command.src);
+        writes.push_back(command.dst);
+      } else {
+        writes.push_back(command.dst);
+      }
 
-    // Write second timestamp.
-    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 1);
+      // Read after write, write after write and write after read all need a barrier
+      bool hazard = false;
+      for (auto buffer : reads) {
+        hazard |= writtenSinceBarrier.count(buffer) > 0;
+      }
+      for (auto buffer : writes) {
+        hazard |= writtenSinceBarrier.count(buffer) > 0 || readSinceBarrier.count(buffer) > 0;
+      }
+      // The barrier covers every later dispatch and transfer, since all tracking is cleared after it
+      if (hazard) {
+        memoryBarrier(commandBuffer, pendingStages, pendingWrites,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+          VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+        readSinceBarrier.clear();
+        writtenSinceBarrier.clear();
+        pendingStages = 0;
+        pendingWrites = 0;
+      }
+      readSinceBarrier.insert(reads.begin(), reads.end());
+      writtenSinceBarrier.insert(writes.begin(), writes.end());
+      pendingStages |= stage;
+      pendingWrites |= writeAccess;
+
+      if (command.type == GRAPH_DISPATCH) {
+        command.program->_recordDispatch(commandBuffer);
+        command.generation = command.program->generation;
+      } else if (command.type == GRAPH_COPY) {
+        VkBufferCopy copyRegion {
+          command.srcOffset,
+          command.dstOffset,
+          command.len
+        };
+        vkCmdCopyBuffer(commandBuffer, command.src, command.dst, 1, &copyRegion);
+      } else {
+        vkCmdFillBuffer(commandBuffer, command.dst, command.dstOffset, VK_WHOLE_SIZE, command.word);
+      }
+    }
 
-    // End recording command buffer
+    // Make the graph's results visible to the host and to later submissions
+    memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_MEMORY_WRITE_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT | VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_HOST_READ_BIT);
     vkCheck(vkEndCommandBuffer(commandBuffer));
+    recorded = true;
+  }
 
-    // Define submit info
-    VkSubmitInfo submitInfo{
-        VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        nullptr,
-        0,
-        nullptr,
-        nullptr,
-        1,
-        &commandBuffer,
-        0,
-        nullptr};
-
-    auto queue = device.computeQueue;
+  Completion CommandGraph::submit(const std::vector<Completion> &waitFor) {
+    // A rebind may have moved a program on to another set of its descriptor set ring, which the recorded
+    // dispatch doesn't reference
+    for (const auto &command : commands) {
+      if (command.type == GRAPH_DISPATCH && command.generation != command.program->generation) {
+        recorded = false;
+      }
+    }
+    if (!recorded) {
+      record();
+    }
+    // A command buffer can't be pending twice, so a replay waits for the previous one to finish
+    lastSubmit.wait();
+    lastSubmit = device.submit(commandBuffer, waitFor);
+    if (!scopeNames.empty()) {
+      device.profiler().submitted(commandBuffer, lastSubmit);
+      recorded = false;
+    }
+    return lastSubmit;
+  }
 
-    // Submit command buffer to queue, signals fence on completion.
-    vkCheck(vkQueueSubmit(queue, 1, &submitInfo, fence));
-    // Wait on fence.
-    vkCheck(vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX));
-    // Reset fence signal.
-    vkCheck(vkResetFences(device.device, 1, &fence));
+  void CommandGraph::run() {
+    submit().wait();
+  }
 
-    // Get timestamp query results.
-    uint64_t queryResults[2] = {0, 0};
+  std::vector<std::pair<std::string, uint64_t>> CommandGraph::timestamps() {
+    std::vector<std::pair<std::string, uint64_t>> result;
+    if (markerNames.empty()) {
+      return result;
+    }
+    std::vector<uint64_t> ticks(markerNames.size());
     vkCheck(vkGetQueryPoolResults(
         device.device,
         timestampQueryPool,
         0,
-        2,
-        sizeof(uint64_t) * 2,
-        queryResults,
+        ticks.size(),
+        ticks.size() * sizeof(uint64_t),
+        ticks.data(),
         sizeof(uint64_t),
         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    for (uint32_t i = 0; i < ticks.size(); i++) {
+      result.push_back({ markerNames[i], device.ticksToNs(ticks[0], ticks[i]) });
+    }
+    return result;
+  }
+
+  void CommandGraph::clear() {
+    commands.clear();
+    markerNames.clear();
+    scopeNames.clear();
+    recorded = false;
+  }
+
+  void CommandGraph::teardown() {
+    lastSubmit.wait();
+    if (profiled) {
+      device.profiler().discard(commandBuffer);
+    }
+    vkDestroyCommandPool(device.device, commandPool, nullptr);
+    if (timestampQueryPool != VK_NULL_HANDLE) {
+      vkDestroyQueryPool(device.device, timestampQueryPool, nullptr);
+    }
+  }
+
+  // -------------------------------------------------------------------------------
 
-    return (queryResults[1] - queryResults[0]) * device.properties.limits.timestampPeriod;
+  Autotuner::Autotuner(Device &_device, std::string _path) : device(_device), path(_path) {
+    if (path.empty()) {
+      return;
+    }
+    // A missing file just means nothing has been tuned yet
+    auto fin = std::ifstream(path);
+    std::string key;
+    TuningResult result;
+    while (fin >> key >> result.workgroupSize >> result.numWorkgroups >> result.ns) {
+      results[key] = result;
+    }
   }
 
-  void Program::setWorkgroups(uint32_t _numWorkgroups) {
-    numWorkgroups = _numWorkgroups;
+  std::string Autotuner::key(Program &program, uint64_t problemSize) {
+    char hex[3];
+    std::string deviceId;
+    for (uint8_t byte : device.uuid()) {
+      snprintf(hex, sizeof(hex), "%02x", byte);
+      deviceId += hex;
+    }
+    char shaderId[17];
+    snprintf(shaderId, sizeof(shaderId), "%016llx", (unsigned long long)program.shaderHash);
+    return deviceId + "/" + shaderId + "/" + program.entryPoint + "/" + std::to_string(problemSize);
   }
 
-  void Program::setWorkgroupSize(uint32_t _workgroupSize) {
-    workgroupSize = _workgroupSize;
+  TuningResult Autotuner::tune(Program &program, uint64_t problemSize, uint32_t repetitions) {
+    if (!program.initialized) {
+      throw std::runtime_error("programs must be initialized before they are tuned");
+    }
+    auto programKey = key(program, problemSize);
+    auto known = results.find(programKey);
+    if (known != results.end()) {
+      program.setWorkgroupSize(known->second.workgroupSize);
+      program.setWorkgroups(known->second.numWorkgroups);
+      return known->second;
+    }
+
+    const auto &limits = device.properties.limits;
+    uint32_t step = std::max(device.subgroupSize(), 1u);
+    uint32_t maxSize = std::min(limits.maxComputeWorkGroupSize[0], limits.maxComputeWorkGroupInvocations);
+    TuningResult best { 0, 0, UINT64_MAX };
+    std::vector<uint64_t> times(std::max(repetitions, 1u));
+    for (uint32_t workgroupSize = step; workgroupSize <= maxSize; workgroupSize += step) {
+      uint64_t numWorkgroups = (problemSize + workgroupSize - 1) / workgroupSize;
+      if (numWorkgroups > limits.maxComputeWorkGroupCount[0]) {
+        continue;
+      }
+      program.setWorkgroupSize(workgroupSize);
+      program.setWorkgroups(numWorkgroups);
+      // The first dispatch of a variant pays for pipeline creation and cold caches
+      program.runWithDispatchTiming();
+      for (auto &time : times) {
+        time = program.runWithDispatchTiming();
+      }
+      std::sort(times.begin(), times.end());
+      uint64_t median = times[times.size() / 2];
+      if (median < best.ns) {
+        best = TuningResult { workgroupSize, (uint32_t)numWorkgroups, median };
+      }
+    }
+    if (best.workgroupSize == 0) {
+      throw std::runtime_error("no workgroup size covers a problem size of " + std::to_string(problemSize));
+    }
+
+    program.setWorkgroupSize(best.workgroupSize);
+    program.setWorkgroups(best.numWorkgroups);
+    results[programKey] = best;
+    if (!path.empty()) {
+      save();
+    }
+    return best;
   }
 
-  void Program::setWorkgroupMemoryLength(uint32_t length, uint32_t index) {
-    workgroupMemoryLengths[index] = length;
+  void Autotuner::save() {
+    auto fout = std::ofstream(path, std::ios::trunc);
+    if (!fout.is_open()) {
+      throw std::runtime_error("failed opening file " + path + " for writing");
+    }
+    for (const auto &[key, result] : results) {
+      fout << key << " " << result.workgroupSize << " " << result.numWorkgroups << " " << result.ns << "\n";
+    }
   }
 
-  Program::Program(Device &_device, std::vector<uint32_t> spvCode, std::vector<Buffer> &_buffers) : device(_device),
-                                                                                                    shaderModule(initShaderModule(_device, spvCode)),
-                                                                                                    buffers(_buffers) {}
+  // -------------------------------------------------------------------------------
 
-  Program::Program(Device &_device, const char *filepath, std::vector<Buffer> &_buffers) : device(_device),
-                                                                                           shaderModule(initShaderModule(_device, filepath)),
-                                                                                           buffers(_buffers) {}
+  Profiler::Profiler(Device &_device, uint32_t _slots) : device(_device), slots(_slots & ~1u), createdNs(hostClockNs()) {
+    if (device.timestampValidBits == 0) {
+      throw std::runtime_error("the compute queue doesn't support timestamps");
+    }
+    VkQueryPoolCreateInfo queryPoolCreateInfo {
+      VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      nullptr,
+      0,
+      VK_QUERY_TYPE_TIMESTAMP,
+      slots
+    };
+    vkCheck(vkCreateQueryPool(device.device, &queryPoolCreateInfo, nullptr, &queryPool));
+  }
 
-  void Program::teardown() {
-    vkDestroyShaderModule(device.device, shaderModule, nullptr);
-    vkDestroyDescriptorPool(device.device, descriptorPool, nullptr);
-    vkDestroyDescriptorSetLayout(device.device, descriptorSetLayout, nullptr);
-    vkDestroyPipelineLayout(device.device, pipelineLayout, nullptr);
-    vkDestroyPipeline(device.device, pipeline, nullptr);
-    vkDestroyFence(device.device, fence, nullptr);
-    vkDestroyCommandPool(device.device, commandPool, nullptr);
-    vkDestroyQueryPool(device.device, timestampQueryPool, VK_NULL_HANDLE);
+  uint32_t Profiler::begin(VkCommandBuffer commandBuffer, const std::string &name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (2 * scopes.size() >= slots) {
+      resolve();
+    }
+    while (2 * scopes.size() >= slots) {
+      if (!scopes.front().submitted) {
+        throw std::runtime_error("profiler ring is full of scopes that were never submitted");
+      }
+      scopes.front().completion.wait();
+      resolve();
+    }
+
+    uint32_t slot = head;
+    head = (head + 2) % slots;
+    // Queries must be reset before every write
+    vkCmdResetQueryPool(commandBuffer, queryPool, slot, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, slot);
+    scopes.push_back(ProfileScope { name, slot, commandBuffer, Completion(), false, false, false });
+    return nextScope++;
+  }
+
+  void Profiler::end(VkCommandBuffer commandBuffer, uint32_t scope) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    uint32_t first = nextScope - scopes.size();
+    if (scope - first >= scopes.size() || scopes[scope - first].ended || scopes[scope - first].discarded) {
+      throw std::runtime_error("ending profiler scope " + std::to_string(scope) + " that isn't open");
+    }
+    auto &profileScope = scopes[scope - first];
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, profileScope.slot + 1);
+    profileScope.ended = true;
+  }
+
+  void Profiler::submitted(VkCommandBuffer commandBuffer, Completion completion) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    for (auto &scope : scopes) {
+      if (!scope.submitted && scope.commandBuffer == commandBuffer) {
+        scope.completion = completion;
+        scope.submitted = true;
+      }
+    }
+  }
+
+  void Profiler::discard(VkCommandBuffer commandBuffer) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    // Scope ids are positions in the ring, so discarded scopes stay in place until they reach the front
+    for (auto &scope : scopes) {
+      if (!scope.submitted && scope.commandBuffer == commandBuffer) {
+        scope.discarded = true;
+      }
+    }
+    resolve();
+  }
+
+  void Profiler::resolve() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    while (!scopes.empty()) {
+      auto &scope = scopes.front();
+      if (scope.discarded) {
+        scopes.pop_front();
+        continue;
+      }
+      if (!scope.submitted || !scope.ended || !signaled(scope.completion)) {
+        break;
+      }
+      uint64_t ticks[2];
+      // The submission has completed, but the results may still not be available, so never wait on them
+      VkResult result = vkGetQueryPoolResults(
+          device.device,
+          queryPool,
+          scope.slot,
+          2,
+          sizeof(ticks),
+          ticks,
+          sizeof(uint64_t),
+          VK_QUERY_RESULT_64_BIT);
+      if (result == VK_NOT_READY) {
+        break;
+      }
+      vkCheck(result);
+      // Calibration error can put a scope that began right away slightly before the profiler existed
+      uint64_t startNs = device.deviceToHostNs(ticks[0]);
+      startNs = startNs > createdNs ? startNs - createdNs : 0;
+      resolved.push_back(ProfileEvent { scope.name, startNs, device.ticksToNs(ticks[0], ticks[1]) });
+      scopes.pop_front();
+    }
+  }
+
+  std::vector<ProfileEvent> Profiler::events() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    resolve();
+    return resolved;
+  }
+
+  void Profiler::writeChromeTrace(const std::string &path) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    resolve();
+    auto fout = std::ofstream(path, std::ios::trunc);
+    if (!fout.is_open()) {
+      throw std::runtime_error("failed opening file " + path + " for writing");
+    }
+    // Complete ("X") events, timestamps and durations in microseconds
+    fout << "{\"traceEvents\": [\n";
+    for (size_t i = 0; i < resolved.size(); i++) {
+      const auto &event = resolved[i];
+      fout << "  {\"name\": \"" << jsonEscape(event.name) << "\", \"cat\": \"gpu\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": "
+           << event.startNs / 1000.0 << ", \"dur\": " << event.durationNs / 1000.0 << "}"
+           << (i + 1 < resolved.size() ? ",\n" : "\n");
+    }
+    fout << "], \"displayTimeUnit\": \"ns\", \"otherData\": {\"device\": \"" << jsonEscape(device.properties.deviceName) << "\"}}\n";
+  }
+
+  void Profiler::teardown() {
+    vkDestroyQueryPool(device.device, queryPool, nullptr);
   }
 }
@@ -17,7 +17,10 @@
 #ifndef EASYVK_H
 #define EASYVK_H
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
 #include <set>
@@ -26,8 +29,13 @@
 #include <stdarg.h>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <deque>
 #include <iostream>
 #include <stdlib.h>
+#include <type_traits>
 
 #include <../volk/volk.h>
 #ifdef __ANDROID__
@@ -38,9 +46,23 @@ namespace easyvk
 {
 
   const uint32_t push_constant_size_bytes = 20;
+  // Default size of the per-device staging ring used by device local buffer transfers
+  const uint64_t default_staging_budget_bytes = 16 * 1024 * 1024;
+  // Default size of the device memory blocks that buffers are sub-allocated from
+  const uint64_t default_memory_block_bytes = 64 * 1024 * 1024;
+  // Smallest placement handed out inside a memory block
+  const uint64_t min_suballocation_bytes = 256;
+  // Timestamp queries in the per-device profiler ring, two per scope
+  const uint32_t default_profiler_query_slots = 4096;
+  // Descriptor sets a Program cycles through when rebinding without push descriptors, so sets referenced by
+  // recently submitted work are not overwritten
+  const uint32_t descriptor_set_ring_size = 4;
+  // Descriptor sets each of the device's shared descriptor pools holds, with room for 8 buffers per set
+  const uint32_t descriptor_pool_sets = 256;
 
   class Device;
   class Buffer;
+  class Profiler;
 
   class Instance
   {
@@ -55,46 +77,372 @@ namespace easyvk
     VkDebugReportCallbackEXT debugReportCallback;
   };
 
+  /**
+   * Lightweight handle to work submitted to a device queue. The work has completed once the
+   * queue's timeline semaphore reaches value. A default constructed handle is always complete.
+   */
+  class Completion {
+  public:
+    // Non-blocking check, finishes any deferred host side work (e.g. readbacks) if complete
+    bool done();
+    void wait();
+
+    easyvk::Device *device = nullptr;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    uint64_t value = 0;
+  };
+
+  typedef struct StagingRegion {
+    uint64_t begin;
+    uint64_t end;
+    bool submitted;
+    Completion completion;
+    // Host destination the region is copied to once the completion signals, if any
+    char *readback;
+    // Thread that reserved the region and has to release it
+    std::thread::id owner;
+  } StagingRegion;
+
+  /**
+   * A persistently mapped, host visible staging buffer shared by all device local buffers
+   * on a device. Transfers larger than the ring are streamed through it in chunks.
+   */
+  class StagingRing {
+  public:
+    StagingRing(Device &_device, uint64_t sizeBytes);
+    // Reserves up to len bytes of staging space and returns its offset in the ring, waiting for
+    // in flight transfers to release space if needed. The number of bytes actually reserved is
+    // written to granted. The ring is only locked while reserving, so other threads can stage their own
+    // regions while this one is filled. Every acquire must be followed by a release of its offset.
+    uint64_t acquire(uint64_t len, uint64_t &granted);
+    // Hands the region acquired at offset to the transfer that uses it. If readback is set, the region
+    // is copied there once the transfer completes.
+    void release(uint64_t offset, Completion completion, char *readback = nullptr);
+    // Copies out the readbacks of completed transfers and frees completed regions from the front of the ring
+    void reclaim();
+    void teardown();
+
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    char *mapped;
+    uint64_t size;
+
+  private:
+    easyvk::Device &device;
+    uint64_t head;
+    std::deque<StagingRegion> regions;
+    // Recursive since waiting for space retires completed work, which reclaims regions
+    std::recursive_mutex lock;
+    // Notified when a region is handed to its transfer
+    std::condition_variable_any released;
+  };
+
+  /**
+   * Device owned pool of one-shot transfer command buffers for all buffer copies and fills, so buffers
+   * themselves hold no command objects. Command buffers are recycled once their submission's completion signals. Work goes to the
+   * device's transfer queue. Each thread gets its own pool, so pools are never shared, and the pool is freed
+   * when its thread exits.
+   */
+  class TransferPool {
+  public:
+    TransferPool(Device &_device);
+    // Returns a command buffer that is ready for recording
+    VkCommandBuffer begin();
+    // Ends recording and submits the command buffer once everything in waitFor has completed
+    Completion submit(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor);
+    void recycle();
+    void teardown();
+
+  private:
+    easyvk::Device &device;
+    VkCommandPool commandPool;
+    std::vector<VkCommandBuffer> available;
+    std::deque<std::pair<Completion, VkCommandBuffer>> inFlight;
+  };
+
+  // The live transfer pools of a device, shared with the threads that own them
+  typedef struct TransferPools {
+    std::mutex lock;
+    std::set<TransferPool*> pools;
+    // Cleared when the device is torn down, which frees every pool left
+    bool open = true;
+  } TransferPools;
+
+  // A buffer's placement in device memory, either inside a shared block or in a dedicated allocation
+  typedef struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    uint64_t offset = 0;
+    uint64_t size = 0; // size that was requested, the placement itself may be larger
+    uint32_t memoryType = 0;
+    uint32_t block = uint32_t(-1); // index of the owning block, -1 for dedicated allocations
+    char *mapped = nullptr; // host pointer to offset if the memory is host visible
+  } Allocation;
+
+  typedef struct MemoryStats {
+    uint32_t blockCount; // live vkAllocateMemory calls backing blocks
+    uint32_t dedicatedCount; // live vkAllocateMemory calls for allocations larger than a block
+    uint32_t allocationCount; // buffers placed inside blocks
+    uint64_t reservedBytes; // device memory held by blocks
+    uint64_t usedBytes; // bytes of blocks handed out, after rounding to buddy sizes
+    uint64_t requestedBytes; // bytes actually requested by buffers placed in blocks
+    uint64_t dedicatedBytes; // device memory held by dedicated allocations
+    uint64_t largestFreeBytes; // largest placement that fits without a new block
+    float utilization; // usedBytes / reservedBytes
+    float fragmentation; // 1 - largestFreeBytes / free bytes, 0 when free space is contiguous
+  } MemoryStats;
+
+  typedef struct MemoryBlock {
+    VkDeviceMemory memory;
+    uint32_t memoryType;
+    char *mapped;
+    // Free offsets per buddy order, order 0 being min_suballocation_bytes
+    std::vector<std::set<uint64_t>> freeLists;
+    // Offset -> buddy order of each live placement
+    std::map<uint64_t, uint32_t> live;
+    uint64_t usedBytes;
+    uint64_t requestedBytes;
+  } MemoryBlock;
+
+  /**
+   * Sub-allocates buffer memory out of large per-memory-type blocks using buddy placement, so that
+   * creating a buffer rarely needs its own vkAllocateMemory. Host visible blocks are mapped once.
+   */
+  class MemoryArena {
+  public:
+    MemoryArena(Device &_device, uint64_t _blockSize);
+    Allocation allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags flags);
+    void free(Allocation &allocation);
+    MemoryStats stats();
+    // Returns completely empty blocks to the driver
+    void trim();
+    void teardown();
+
+  private:
+    easyvk::Device &device;
+    uint64_t blockSize;
+    uint32_t maxOrder;
+    std::vector<MemoryBlock> blocks;
+    uint32_t dedicatedCount = 0;
+    uint64_t dedicatedBytes = 0;
+    std::mutex lock;
+    uint32_t newBlock(uint32_t memoryType);
+  };
+
+  /**
+   * Device owned cache of descriptor set layouts and pipeline layouts, keyed by their signature so Programs
+   * with identical interfaces share them. Descriptor sets come from large shared pools, with a new pool
+   * added whenever the existing ones are exhausted. Everything is destroyed with the device.
+   */
+  class LayoutCache {
+  public:
+    LayoutCache(Device &_device);
+    // The layout with one binding of each type, in order
+    VkDescriptorSetLayout descriptorSetLayout(const std::vector<VkDescriptorType> &types, bool pushDescriptors);
+    // setLayout may be VK_NULL_HANDLE for programs without descriptors. No push constant range when pushConstantBytes is 0.
+    VkPipelineLayout pipelineLayout(VkDescriptorSetLayout setLayout, uint32_t pushConstantBytes);
+    // Allocates count sets with a layout made by this cache, returning the pool they came from
+    VkDescriptorPool allocate(VkDescriptorSetLayout setLayout, uint32_t count, VkDescriptorSet *sets);
+    void free(VkDescriptorPool pool, const std::vector<VkDescriptorSet> &sets);
+    void teardown();
+
+  private:
+    easyvk::Device &device;
+    std::map<std::pair<std::vector<VkDescriptorType>, bool>, VkDescriptorSetLayout> setLayouts;
+    std::map<VkDescriptorSetLayout, std::vector<VkDescriptorType>> setLayoutTypes;
+    std::map<std::pair<VkDescriptorSetLayout, uint32_t>, VkPipelineLayout> pipelineLayouts;
+    std::vector<VkDescriptorPool> pools;
+    std::mutex lock;
+    VkDescriptorPool newPool(const std::vector<VkDescriptorType> &types, uint32_t count);
+  };
+
   class Device
   {
   public:
-    Device(Instance &_instance, VkPhysicalDevice _physicalDevice);
+    Device(Instance &_instance, VkPhysicalDevice _physicalDevice, uint64_t _stagingBudget = default_staging_budget_bytes,
+      uint64_t _memoryBlockSize = default_memory_block_bytes);
     VkDevice device;
     VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
     uint32_t selectMemory(uint32_t memoryTypeBits, VkMemoryPropertyFlags flags);
     uint32_t computeFamilyId = uint32_t(-1);
     uint32_t subgroupSize();
+    // VkPhysicalDeviceIDProperties::deviceUUID, stable across processes and driver restarts
+    std::array<uint8_t, VK_UUID_SIZE> uuid();
     const char* vendorName();
     VkQueue computeQueue;
+    // Timeline semaphore signaled by every submission made through submit()
+    VkSemaphore computeTimeline;
+    // Queue used for buffer transfers. This is a transfer-only family when the device has one, otherwise a
+    // second queue of the compute family, falling back to computeQueue itself on single queue devices.
+    uint32_t transferFamilyId = uint32_t(-1);
+    VkQueue transferQueue;
+    VkSemaphore transferTimeline;
+    // Submits a recorded command buffer to the compute queue after everything in waitFor has completed
+    Completion submit(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor = {}, VkFence fence = VK_NULL_HANDLE);
+    // Same as submit, but to the transfer queue
+    Completion submitTransfer(VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor = {}, VkFence fence = VK_NULL_HANDLE);
+    bool hasTransferQueue();
+    // Recycles staging space and the calling thread's command buffers of completed transfers and finishes
+    // their readbacks
+    void retire();
     // AMD shader info extension gives more register info than the portable stats extension
     bool supportsAMDShaderStats;
+    // Whether Programs can count executed invocations with enablePipelineStatistics()
+    bool supportsPipelineStatistics;
+    // Staging ring used by device local buffers, created on first use
+    StagingRing &stagingRing();
+    // Block allocator that backs every buffer created on this device
+    MemoryArena &memoryArena();
+    MemoryStats memoryStats();
+    // Layouts and descriptor pools shared by every Program on this device, created on first use
+    LayoutCache &layoutCache();
+    // The calling thread's command buffers for asynchronous transfers, created on first use
+    TransferPool &transferPool();
+    // Timestamp profiler for scopes recorded on the compute queue, created on first use
+    Profiler &profiler();
+    // Meaningful bits in compute queue timestamps, 0 if the queue doesn't support them
+    uint32_t timestampValidBits;
+    uint64_t timestampMask();
+    // Device nanoseconds between two compute queue timestamps, across counter wraparound
+    uint64_t ticksToNs(uint64_t begin, uint64_t end);
+    // Maps a compute queue timestamp onto hostClockNs(), recalibrating when the last calibration is stale
+    uint64_t deviceToHostNs(uint64_t ticks);
+    // Correlates the device and host clocks with VK_EXT_calibrated_timestamps when supported, otherwise by
+    // timing a submission that only writes a timestamp
+    void calibrate();
+    bool supportsCalibratedTimestamps;
+    // Whether Buffers can wrap existing host memory in place with VK_EXT_external_memory_host
+    bool supportsHostImport;
+    // Alignment the address and size of imported host memory must have, 0 without the extension
+    uint64_t minImportedHostPointerAlignment = 0;
+    // Memory types host memory at pointer can be imported as, 0 if it can't be imported
+    uint32_t hostPointerMemoryTypes(const void *pointer);
+    // Whether buffers can be passed to kernels by address, see Buffer::deviceAddress
+    bool supportsBufferDeviceAddress;
+    // Whether Programs can record their bindings with VK_KHR_push_descriptor instead of descriptor sets
+    bool supportsPushDescriptors;
+    uint32_t maxPushDescriptors = 0;
+    PFN_vkCmdPushDescriptorSetKHR cmdPushDescriptorSet = nullptr;
+    // Cache used when creating the pipeline of every Program on this device
+    VkPipelineCache pipelineCache;
+    // Merges a cache written by savePipelineCache into pipelineCache. Returns false and leaves the cache
+    // untouched if the file is missing or was written for a different device or driver version.
+    bool loadPipelineCache(const std::string &path);
+    void savePipelineCache(const std::string &path);
     void teardown();
   private:
     Instance &instance;
     VkPhysicalDevice physicalDevice;
+    uint64_t stagingBudget;
+    StagingRing *staging = nullptr;
+    uint64_t memoryBlockSize;
+    MemoryArena *arena = nullptr;
+    LayoutCache *layouts = nullptr;
+    uint64_t computeTimelineValue = 0;
+    uint64_t transferTimelineValue = 0;
+    std::shared_ptr<TransferPools> transfers = std::make_shared<TransferPools>();
+    Profiler *profile = nullptr;
+    PFN_vkGetCalibratedTimestampsEXT getCalibratedTimestamps = nullptr;
+    PFN_vkGetMemoryHostPointerPropertiesEXT getMemoryHostPointerProperties = nullptr;
+    bool calibrated = false;
+    uint64_t calibrationTicks = 0;
+    uint64_t calibrationHostNs = 0;
+    uint64_t calibratedAt = 0;
+    // Queues are externally synchronized, these are held only around signal value assignment and vkQueueSubmit
+    std::mutex computeQueueLock;
+    std::mutex transferQueueLock;
+    // Guards creation of the lazily created objects above
+    std::mutex objectsLock;
+    std::recursive_mutex calibrationLock;
+    Completion submitTo(VkQueue queue, std::mutex &queueLock, VkSemaphore timeline, uint64_t &timelineValue, VkSemaphore otherTimeline,
+      VkCommandBuffer commandBuffer, const std::vector<Completion> &waitFor, VkFence fence);
   };
 
   class Buffer {
   public:
     Buffer(Device &device, uint64_t sizeBytes, bool deviceLocal = false);
+    // Wraps sizeBytes of existing host memory so the device reads and writes it in place, with no second
+    // resident copy. hostPointer and sizeBytes must be aligned to minImportedHostPointerAlignment and the
+    // memory must outlive the buffer. When the device or the memory doesn't allow importing, this falls back
+    // to a host visible buffer holding a copy; check imported, and load() results back in that case.
+    Buffer(Device &device, void *hostPointer, uint64_t sizeBytes);
     void teardown();
     void copy(Buffer dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0);  
     void store(void* src, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0);
     void load(void* dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0);
     void clear();
     void fill(uint32_t word, uint64_t offset = 0);
+    // Asynchronous variants return as soon as the work is submitted and only start once everything in
+    // waitFor has completed. src may be reused as soon as storeAsync returns; dst of loadAsync is written
+    // when the returned completion is found done or waited on. Transfers run on the device's transfer
+    // queue, so Programs only see their results once the completion has been waited on or found done.
+    Completion copyAsync(Buffer dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0, const std::vector<Completion> &waitFor = {});
+    Completion storeAsync(void* src, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0, const std::vector<Completion> &waitFor = {});
+    Completion loadAsync(void* dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0, const std::vector<Completion> &waitFor = {});
+    Completion fillAsync(uint32_t word, uint64_t offset = 0, const std::vector<Completion> &waitFor = {});
+    // Typed pointer into the persistently mapped memory of a host visible buffer (nullptr if device local).
+    // Call flush() after writing and invalidate() before reading when the memory is not host coherent.
+    template<typename T> T* data() { return reinterpret_cast<T*>(mapped); }
+    void flush(uint64_t len = VK_WHOLE_SIZE, uint64_t offset = 0);
+    void invalidate(uint64_t len = VK_WHOLE_SIZE, uint64_t offset = 0);
+    // Address of the buffer's first byte for kernels that take physical storage buffer pointers. Throws if
+    // the device doesn't support buffer device addresses.
+    uint64_t deviceAddress();
     void _copy(VkBuffer src, VkBuffer dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0);
+    Completion _copyAsync(VkBuffer src, VkBuffer dst, uint64_t len, uint64_t srcOffset, uint64_t dstOffset, const std::vector<Completion> &waitFor);
     void _createVkBuffer(VkBuffer* buf, VkDeviceMemory* mem, uint64_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props);
+    void _create(const void *pNext);
+    void _place(VkMemoryPropertyFlags memProp);
 
     easyvk::Device &device;
-    VkCommandPool commandPool;
-    VkCommandBuffer commandBuffer;
+    Allocation allocation;
     VkDeviceMemory memory;
     VkBuffer buffer;
     uint64_t size;
     bool deviceLocal;
+    // Host visible buffers are mapped once at creation
+    char *mapped = nullptr;
+    bool coherent = true;
+    // True when the buffer aliases the host memory it was constructed from
+    bool imported = false;
   };
 
+  /**
+   * A range of a Buffer that a Program binds in place of the whole buffer, so one allocation can feed many
+   * kernels. Buffers convert to a view of all of themselves. A dynamic view's offset can later be moved
+   * with Program::setBindingOffset, which re-points recorded dispatches without rewriting descriptors.
+   */
+  class BufferView {
+  public:
+    BufferView(Buffer &buffer);
+    // Throws if offset isn't a multiple of minStorageBufferOffsetAlignment or the range runs past the buffer
+    BufferView(Buffer &buffer, uint64_t offset, uint64_t range = VK_WHOLE_SIZE, bool dynamic = false);
+    VkBuffer buffer;
+    uint64_t bufferSize;
+    uint64_t offset;
+    // Always explicit, VK_WHOLE_SIZE is resolved to the rest of the buffer
+    uint64_t range;
+    bool dynamic;
+  };
+
+  // Nanoseconds on the host's monotonic clock
+  uint64_t hostClockNs();
+
+  /**
+   * Where the time of one dispatch went, on the host's monotonic clock: submit overhead is
+   * submittedNs - submitNs, queue wait startNs - submittedNs, execution endNs - startNs and the
+   * host noticing completion completeNs - endNs.
+   */
+  typedef struct DispatchTimeline {
+    uint64_t submitNs;
+    uint64_t submittedNs;
+    uint64_t startNs;
+    uint64_t endNs;
+    uint64_t completeNs;
+    // Device measured execution time, exact even if the clocks are not calibrated
+    uint64_t durationNs;
+  } DispatchTimeline;
+
   typedef struct ShaderStatistics {
     std::string name;
     std::string description;
@@ -102,6 +450,38 @@ namespace easyvk
     uint64_t value; // may need to cast this to get the right value based on the format
   } ShaderStatistics;
 
+  // A descriptor an entry point uses
+  typedef struct ReflectedBinding {
+    uint32_t set;
+    uint32_t binding;
+    VkDescriptorType type;
+    uint32_t count; // array size of the descriptor, 1 when it isn't an array
+  } ReflectedBinding;
+
+  // A variable in workgroup (OpenCL local) memory
+  typedef struct ReflectedWorkgroupVariable {
+    uint32_t specId; // specialization constant holding the array length, -1 if the size is fixed
+    uint32_t elementBytes; // bytes per array element, only meaningful with a specId
+    uint64_t sizeBytes; // size with the default length
+  } ReflectedWorkgroupVariable;
+
+  // The interface of one compute entry point, as declared by its SPIR-V
+  typedef struct ShaderInterface {
+    std::string entryPoint;
+    // Sorted by set and binding
+    std::vector<ReflectedBinding> bindings;
+    // Size of the push constant block, 0 if the entry point has none
+    uint32_t pushConstantBytes = 0;
+    // LocalSize execution mode or WorkgroupSize default values
+    std::array<uint32_t, 3> localSize = {1, 1, 1};
+    // Specialization constants the local size is read from, -1 for dimensions fixed in the shader
+    std::array<uint32_t, 3> localSizeSpecIds = {uint32_t(-1), uint32_t(-1), uint32_t(-1)};
+    std::vector<ReflectedWorkgroupVariable> workgroupVariables;
+  } ShaderInterface;
+
+  // Reads the interface of every entry point in a SPIR-V module. Throws if the module is malformed.
+  std::vector<ShaderInterface> reflectSpirv(const std::vector<uint32_t> &spvCode);
+
   /**
    * A program consists of shader code and the buffers/inputs to the shader
    * Buffers should be passed in according to their argument order in the shader.
@@ -109,38 +489,306 @@ namespace easyvk
    */
   class Program {
   public:
+    // buffers is kept by reference and read by initialize, so changes made to it before then are picked up
     Program(Device &_device, const char *filepath, std::vector<easyvk::Buffer> &buffers);
     Program(Device &_device, std::vector<uint32_t> spvCode, std::vector<easyvk::Buffer> &buffers);
+    // Binding i is views[i]
+    Program(Device &_device, const char *filepath, const std::vector<easyvk::BufferView> &views);
+    Program(Device &_device, std::vector<uint32_t> spvCode, const std::vector<easyvk::BufferView> &views);
+    // A program without bindings, whose kernel reaches its buffers through addresses in push constants
+    // set with setBufferAddress. No descriptor set is created or bound.
+    Program(Device &_device, const char *filepath);
+    Program(Device &_device, std::vector<uint32_t> spvCode);
+    // Builds the layout and pipeline. The push constant range and local size come from the entry point's
+    // reflected interface. The descriptor set layout has one storage buffer binding per buffer the program
+    // was given. Reflection only checks that those cover every binding the entry point uses, and throws if
+    // one is missing or isn't a single storage buffer in set 0. Also throws if the entry point doesn't exist.
     void initialize(const char *entry_point, VkPipelineShaderStageCreateFlags pipelineFlags = 0);
+    // Interface of the entry point, reflected from the shader. Only valid after initialize.
+    const ShaderInterface &shaderInterface();
+    // Includes the executed compute invocations of the most recent run when pipeline statistics are enabled
     std::vector<ShaderStatistics> getShaderStats();
+    // Opt in to counting compute shader invocations around every dispatch. Throws if the device doesn't
+    // support pipeline statistics queries.
+    void enablePipelineStatistics(bool enable = true);
     void run();
-    float runWithDispatchTiming();
-    void setWorkgroups(uint32_t _numWorkgroups);
-    void setWorkgroupSize(uint32_t _workgroupSize);
+    // Sets the push constants and runs, the values stay set for later runs
+    template<typename T> void run(const T &pushConstants) {
+      setPushConstants(pushConstants);
+      run();
+    }
+    // Device nanoseconds between the start and end of the dispatch
+    uint64_t runWithDispatchTiming();
+    // Like runWithDispatchTiming, with the device timestamps mapped onto the host clock
+    DispatchTimeline runWithTimeline();
+    // Dispatches with the x/y/z workgroup counts stored as a VkDispatchIndirectCommand at offset in
+    // args, e.g. written by an earlier program. Throws if the command doesn't fit in the buffer.
+    void runIndirect(Buffer &args, uint64_t offset = 0);
+    // Copies value into the program's push constant block at offset. Changing the values re-records the
+    // program's command buffers on the next run. Throws if the block would exceed maxPushConstantsSize.
+    template<typename T> void setPushConstants(const T &value, uint32_t offset = 0) {
+      static_assert(std::is_trivially_copyable<T>::value, "push constants must be trivially copyable");
+      setPushConstants(&value, sizeof(T), offset);
+    }
+    void setPushConstants(const void *data, uint32_t size, uint32_t offset = 0);
+    // Writes buffer's device address into the push constants at offset. CommandGraphs order the program
+    // against the buffers given here, but not against buffers the kernel reaches by following pointers.
+    void setBufferAddress(uint32_t offset, Buffer &buffer);
+    // Throws if a count exceeds the device's maxComputeWorkGroupCount
+    void setWorkgroups(uint32_t x, uint32_t y = 1, uint32_t z = 1);
+    // Local size, throws if it exceeds the device's limits or, once initialized, differs from a size the shader
+    // fixes. Changing it or a workgroup memory length after initialize switches to the pipeline compiled for
+    // the new values, compiling it the first time. Dimensions the shader fixes default to its size.
+    void setWorkgroupSize(uint32_t x, uint32_t y = 1, uint32_t z = 1);
     void setWorkgroupMemoryLength(uint32_t length, uint32_t index);
+    // Replace the buffers bound to the program without recompiling its pipeline. Takes effect on the next
+    // run, or when a CommandGraph containing the program is next recorded. After initialize the number of
+    // bindings and which of them are dynamic can't change, a mismatch throws.
+    void bind(uint32_t index, const BufferView &view);
+    void bindAll(const std::vector<BufferView> &views);
+    void bindAll(std::vector<Buffer> &buffers);
+    // Moves a dynamic binding to offset in its buffer, keeping its range. Re-records the program's command
+    // buffers on the next run but leaves the descriptor set alone. Throws if the binding isn't dynamic, the
+    // offset is misaligned or the range would run past the buffer.
+    void setBindingOffset(uint32_t index, uint64_t offset);
+    // Records binding and dispatching the program into a command buffer that is already recording. Workgroup
+    // counts are read from indirectBuffer at indirectOffset when it is set.
+    void _recordDispatch(VkCommandBuffer commandBuffer, VkBuffer indirectBuffer = VK_NULL_HANDLE, uint64_t indirectOffset = 0);
     void teardown();
 
   private:
-    std::vector<easyvk::Buffer> &buffers;
+    friend class CommandGraph;
+    friend class Autotuner;
+    std::vector<easyvk::BufferView> bindings;
+    // Buffers given to the constructor by reference, copied into bindings by initialize or by the first
+    // bind or bindAll, whichever comes first
+    std::vector<easyvk::Buffer> *buffers = nullptr;
+    // Offsets of the dynamic bindings in binding order, applied when the descriptor set is bound
+    std::vector<uint32_t> dynamicOffsets;
+    // Buffers passed by address through setBufferAddress, keyed by push constant offset
+    std::map<uint32_t, VkBuffer> addressedBuffers;
     std::map<uint32_t, uint32_t> workgroupMemoryLengths;
     VkShaderModule shaderModule;
+    uint64_t shaderHash;
+    // Every entry point of the shader, and the one chosen by initialize
+    std::vector<ShaderInterface> entryPoints;
+    ShaderInterface reflected;
     easyvk::Device &device;
     VkDescriptorSetLayout descriptorSetLayout;
-    VkDescriptorPool descriptorPool;
-    VkDescriptorSet descriptorSet;
+    // Layouts belong to the device's LayoutCache and the ring's sets to one of its shared pools
+    VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+    // Without push descriptors each rebind writes the next set of the ring, descriptorSet is the current one
+    std::vector<VkDescriptorSet> descriptorSets;
+    VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+    uint32_t descriptorSetIndex = 0;
+    bool usePushDescriptors = false;
     std::vector<VkWriteDescriptorSet> writeDescriptorSets;
     std::vector<VkDescriptorBufferInfo> bufferInfos;
     VkPipelineLayout pipelineLayout;
-    VkPipeline pipeline;
+    // Pipeline for the current specialization constants, one of pipelineVariants
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    // Every pipeline compiled so far, keyed by specialization constant id and value. They share the
+    // program's layout, descriptor set and command buffers.
+    std::map<std::map<uint32_t, uint32_t>, VkPipeline> pipelineVariants;
+    std::string entryPoint;
+    VkPipelineShaderStageCreateFlags pipelineFlags = 0;
+    bool initialized = false;
     VkCommandPool commandPool; 
-    uint32_t numWorkgroups;
-    uint32_t workgroupSize;
+    std::array<uint32_t, 3> numWorkgroups = {0, 1, 1};
+    // Zero initialized and sized to the device limit, the shader's whole block is pushed on every dispatch
+    std::vector<uint8_t> pushConstants;
+    // Size of the layout's push constant range, the shader's block rounded up to 4 bytes once initialized
+    uint32_t pushConstantRangeBytes;
+    std::array<uint32_t, 3> workgroupSize = {1, 1, 1};
+    bool workgroupSizeSet = false;
     VkFence fence;
+    // run(), runWithDispatchTiming() and runIndirect() each replay their own command buffer, which is only
+    // re-recorded after state it captured (e.g. the workgroup count) changes
     VkCommandBuffer commandBuffer;
+    VkCommandBuffer timedCommandBuffer;
+    VkCommandBuffer indirectCommandBuffer;
+    bool recorded = false;
+    bool timedRecorded = false;
+    bool indirectRecorded = false;
+    // Bumped with every invalidation, so CommandGraphs that recorded a dispatch of the program know to re-record it
+    uint64_t generation = 0;
+    VkBuffer indirectBuffer = VK_NULL_HANDLE;
+    uint64_t indirectOffset = 0;
     VkQueryPool timestampQueryPool;
+    VkQueryPool statisticsQueryPool = VK_NULL_HANDLE;
+    bool statisticsAvailable = false;
+    DispatchTimeline timedRun(bool onHostClock);
+    void recordRun(VkCommandBuffer commandBuffer, bool timed, VkBuffer indirectBuffer = VK_NULL_HANDLE, uint64_t indirectOffset = 0);
+    void submitAndWait(VkCommandBuffer commandBuffer);
+    void invalidateRecordings();
+    void writeBindings();
+    void rebind();
+    void adoptBuffers();
+    std::map<uint32_t, uint32_t> specializationConstants();
+    void selectPipeline();
+  };
+
+  typedef enum GraphCommandType {
+    GRAPH_DISPATCH,
+    GRAPH_COPY,
+    GRAPH_FILL,
+    GRAPH_TIMESTAMP,
+    GRAPH_SCOPE_BEGIN,
+    GRAPH_SCOPE_END
+  } GraphCommandType;
+
+  typedef struct GraphCommand {
+    GraphCommandType type;
+    Program *program;
+    VkBuffer src;
+    VkBuffer dst;
+    uint64_t len;
+    uint64_t srcOffset;
+    uint64_t dstOffset;
+    uint32_t word;
+    uint32_t query;
+    // Program generation the dispatch was recorded with
+    uint64_t generation;
+  } GraphCommand;
+
+  /**
+   * An ordered list of program dispatches, buffer copies, fills and timestamp markers that is recorded
+   * into one command buffer and submitted to the compute queue as a single submission. A barrier is only
+   * inserted before a command that touches a buffer written earlier in the graph, or writes a buffer read
+   * earlier in the graph. The recorded graph is replayed on every submit until commands are added.
+   * Dispatches use the state their program has at submit time: the graph is re-recorded when a program
+   * changed its workgroup count, push constants, pipeline or bindings since the graph was recorded.
+   */
+  class CommandGraph {
+  public:
+    CommandGraph(Device &_device);
+    // Programs must be initialized before the graph is recorded
+    void dispatch(Program &program);
+    void copy(Buffer &src, Buffer &dst, uint64_t len, uint64_t srcOffset = 0, uint64_t dstOffset = 0);
+    void fill(Buffer &buffer, uint32_t word, uint64_t offset = 0);
+    // Records the time at which everything before the marker has finished executing
+    void timestamp(std::string name);
+    // Profiles the commands between the two as a named scope in the device's Profiler. Scopes can nest.
+    // Graphs with scopes are re-recorded on every submit so each run gets its own queries.
+    void beginScope(std::string name);
+    void endScope();
+    // Recording happens on the first submit after commands are added, calling it earlier moves the cost
+    void record();
+    Completion submit(const std::vector<Completion> &waitFor = {});
+    // Submits and waits for the graph to finish
+    void run();
+    // Device nanoseconds of each marker since the first marker, from the most recent run
+    std::vector<std::pair<std::string, uint64_t>> timestamps();
+    void clear();
+    void teardown();
+
+  private:
+    easyvk::Device &device;
+    std::vector<GraphCommand> commands;
+    std::vector<std::string> markerNames;
+    std::vector<std::string> scopeNames;
+    VkCommandPool commandPool;
+    VkCommandBuffer commandBuffer;
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+    uint32_t timestampQueryCount = 0;
+    bool recorded = false;
+    // Whether the current recording holds profiler scopes
+    bool profiled = false;
+    Completion lastSubmit;
+  };
+
+  typedef struct TuningResult {
+    uint32_t workgroupSize;
+    uint32_t numWorkgroups;
+    // Median dispatch time
+    uint64_t ns;
+  } TuningResult;
+
+  /**
+   * Picks the 1D workgroup size of a program for a problem size by timing dispatches at every multiple
+   * of the subgroup size the device allows. Results are kept per device UUID, shader, entry point and
+   * problem size, and persisted to a tuning file when a path is given so later runs skip the sweep.
+   * Kernels must bounds check, as the dispatched grid is rounded up to whole workgroups.
+   */
+  class Autotuner {
+  public:
+    // Loads previously tuned results from path if it exists
+    Autotuner(Device &_device, std::string _path = "");
+    // Applies the best configuration to an initialized program, tuning it first if it isn't known yet
+    TuningResult tune(Program &program, uint64_t problemSize, uint32_t repetitions = 10);
+    void save();
+
+  private:
+    easyvk::Device &device;
+    std::string path;
+    std::map<std::string, TuningResult> results;
+    std::string key(Program &program, uint64_t problemSize);
+  };
+
+  typedef struct ProfileScope {
+    std::string name;
+    // First of the scope's two slots in the query ring
+    uint32_t slot;
+    // Command buffer the scope was recorded into, only its submission stamps the scope
+    VkCommandBuffer commandBuffer;
+    Completion completion;
+    bool submitted;
+    bool ended;
+    // Recorded into a command buffer that was recorded again before being submitted, never resolves
+    bool discarded;
+  } ProfileScope;
+
+  typedef struct ProfileEvent {
+    std::string name;
+    // Nanoseconds since the profiler was created, on the host clock through the device's calibration
+    uint64_t startNs;
+    uint64_t durationNs;
+  } ProfileEvent;
+
+  /**
+   * Named begin/end scopes around commands recorded for the compute queue, timed with a ring of
+   * timestamp queries. Scopes are resolved lazily once their submission has completed, so reading
+   * results never stalls on queries that are still in flight. Scopes may execute in a different order than
+   * they began, so each start is placed on the host clock with Device::deviceToHostNs instead of being
+   * unwrapped against the previous scope. Durations are device ticks converted with Device::ticksToNs.
+   */
+  class Profiler {
+  public:
+    Profiler(Device &_device, uint32_t _slots = default_profiler_query_slots);
+    // Records the start of a scope into a command buffer that is recording and returns its id. Waits for
+    // the oldest scopes to resolve if the ring is full.
+    uint32_t begin(VkCommandBuffer commandBuffer, const std::string &name);
+    void end(VkCommandBuffer commandBuffer, uint32_t scope);
+    // Associates the scopes recorded into commandBuffer and not yet submitted with the submission that executes it
+    void submitted(VkCommandBuffer commandBuffer, Completion completion);
+    // Drops the scopes recorded into commandBuffer that were never submitted, since their queries are never
+    // written. Call before the command buffer is reset or recorded again.
+    void discard(VkCommandBuffer commandBuffer);
+    // Collects the results of completed scopes without waiting, stopping at the first that isn't available yet
+    void resolve();
+    std::vector<ProfileEvent> events();
+    // Writes resolved scopes as Chrome trace JSON, which Perfetto and chrome://tracing load
+    void writeChromeTrace(const std::string &path);
+    void teardown();
+
+  private:
+    easyvk::Device &device;
+    VkQueryPool queryPool;
+    uint32_t slots;
+    uint32_t head = 0;
+    // Scope ids handed out so far, the front of scopes has id nextScope - scopes.size()
+    uint32_t nextScope = 0;
+    std::deque<ProfileScope> scopes;
+    std::vector<ProfileEvent> resolved;
+    // hostClockNs() when the profiler was created, the origin of event start times
+    uint64_t createdNs;
+    // Recursive since begin resolves scopes when the ring is full
+    std::recursive_mutex lock;
   };
 
   const char *vkDeviceType(VkPhysicalDeviceType type);
+  // Escapes quotes, backslashes and control characters for use inside a JSON string literal
+  std::string jsonEscape(const std::string &text);
 }
 
 #endif